@@ -4,11 +4,44 @@
 #include <limits.h>
 #include <math.h>
 #include <setjmp.h>
+#include <time.h>
+
+#if defined(LUA_USE_JIT)&&!(defined(__x86_64__)&&defined(__linux__))
+#undef LUA_USE_JIT
+#endif
+#ifdef LUA_NANBOX
+#include <stdint.h>
+#undef LUA_USE_JIT
+#endif
+#ifdef LUA_USE_JIT
+#include <sys/mman.h>
+#endif
+#if defined(LUA_USE_SWISS)&&defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if !(defined(__GNUC__)&&(defined(__unix__)||defined(__APPLE__)))
+#undef LUA_USE_PARMARK
+#undef LUA_USE_BGSWEEP
+#endif
+#if defined(__unix__)||defined(__APPLE__)
+#define LUA_USE_MKSTEMP
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(LUA_USE_PARMARK)||defined(LUA_USE_BGSWEEP)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 static void *luaM_realloc_(lua_State *L, void *block, size_t oldsize, size_t size);
 
 static void *luaM_toobig(lua_State *L);
 
+#ifdef LUA_USE_BGSWEEP
+static void bg_drain(lua_State *L);
+#endif
+
 static void *luaM_growaux_(lua_State *L, void *block, int *size,
                            size_t size_elem, int limit, const char *errormsg);
 
@@ -102,9 +135,27 @@ typedef enum {
     OP_SETLIST,     // 批量设置表元素
     OP_CLOSE,       // 关闭一个函数
     OP_CLOSURE,     // 用于创建一个闭包
-    OP_VARARG       // 用于获取可变数量的参数
+    OP_VARARG,      // 用于获取可变数量的参数
+    OP_GETFIELD,    // 以字符串常量为键从表中取值 (常量键的 OP_GETTABLE)
+    // 以下为运行时改写出的特化指令, 编译器不会生成
+    OP_ADDNN,       // [+] 两个操作数都是寄存器里的数字
+    OP_SUBNN,
+    OP_MULNN,
+    OP_DIVNN,
+    OP_MODNN,
+    OP_POWNN,
+    OP_ADDNK,       // [+] 寄存器里的数字与数字常量
+    OP_SUBNK,
+    OP_MULNK,
+    OP_DIVNK,
+    OP_MODNK,
+    OP_POWNK
 } OpCode;
 
+#define NUM_OPCODES (cast(int,OP_POWNK)+1)
+// 把特化后的算术指令还原成对应的通用指令
+#define genericop(o)((o)>=OP_ADDNN?cast(OpCode,((o)-OP_ADDNN)%6+OP_ADD):(o))
+
 /*
 ** masks for instruction properties. The format is:
 ** bits 0-1: op mode
@@ -170,17 +221,27 @@ typedef struct GCheader {
     lu_byte marked;     // 用于表示对象的标记信息，通常用于在垃圾回收过程中标记对象的存活状态
 } GCheader;
 
+#ifdef LUA_NANBOX
+// NaN-boxing: 整个值压进 8 个字节. 数字按 double 原样存放 (NaN 统一成 NB_NAN);
+// 其它类型的高 17 位是 0x1FFF1+类型编号, 落在数字永远不会用到的负 quiet NaN 区间里, 低 47 位存放指针或布尔值
+typedef union lua_TValue {
+    uint64_t u;     // 按位访问, 类型与负载都在这里
+    lua_Number n;   // 数字直接按 double 访问
+} TValue;
+#else
 typedef union {
     GCObject *gc;   // 用于指向 Lua 中的垃圾回收对象
     void *p;        // 在 Lua 中，这种指针通常被用于表示通用的指针类型
     lua_Number n;   // 通常用于表示 Lua 中的浮点数
     int b;          // 用于表示布尔值
+    lua_Integer i;  // 整数模式 for 循环的内部槽位
 } Value;
 
 typedef struct lua_TValue {
     Value value;    // 用于存储实际的值数据
     int tt;         // 它被用来标识值的类型（type tag）
 } TValue;
+#endif
 
 typedef TValue *StkId;
 
@@ -226,31 +287,54 @@ static void luaG_runerror(lua_State *L, const char *fmt, ...);
 #define svalue(o)getstr(rawtsvalue(o))
 
 
+#ifdef LUA_NANBOX
+#define NB_TAG(t)((cast(uint64_t,0x1FFF1)+cast(uint64_t,t))<<47)
+#define NB_PAYLOAD ((cast(uint64_t,1)<<47)-1)
+#define NB_NAN cast(uint64_t,0x7FF8000000000000ULL)
+#define nb_isnumber(o)(((o)->u>>47)<=0x1FFF0)
+#define nb_gc(o)cast(GCObject*,cast(uintptr_t,(o)->u&NB_PAYLOAD))
+#define nb_set(obj, t, x){TValue*i_o=(obj);i_o->u=NB_TAG(t)|cast(uint64_t,cast(uintptr_t,(x)));}
+#define ttype(o)(nb_isnumber(o)?3:cast_int((o)->u>>47)-0x1FFF1)
+#define gcvalue(o)check_exp(iscollectable(o),nb_gc(o))
+#define pvalue(o)check_exp(ttislightuserdata(o),cast(void*,nb_gc(o)))
+#define nvalue(o)check_exp(ttisnumber(o),(o)->n)
+#define rawtsvalue(o)check_exp(ttisstring(o),&nb_gc(o)->ts)
+#define rawuvalue(o)check_exp(ttisuserdata(o),&nb_gc(o)->u)
+#define clvalue(o)check_exp(ttisfunction(o),&nb_gc(o)->cl)
+#define hvalue(o)check_exp(ttistable(o),&nb_gc(o)->h)
+#define bvalue(o)check_exp(ttisboolean(o),cast_int((o)->u&NB_PAYLOAD))
+#define thvalue(o)check_exp(ttisthread(o),&nb_gc(o)->th)
+#define setnilvalue(obj)((obj)->u=NB_TAG(LUA_TNIL))
+#define setnvalue(obj, x){TValue*i_o=(obj);lua_Number i_n=(x);if(luai_numisnan(i_n))i_o->u=NB_NAN;else i_o->n=i_n;}
+#define setbvalue(obj, x){TValue*i_o=(obj);i_o->u=NB_TAG(1)|cast(uint64_t,(x)!=0);}
+#define setsvalue(L, obj, x)nb_set(obj,4,x)
+#define setuvalue(L, obj, x)nb_set(obj,7,x)
+#define setthvalue(L, obj, x)nb_set(obj,8,x)
+#define setclvalue(L, obj, x)nb_set(obj,6,x)
+#define sethvalue(L, obj, x)nb_set(obj,5,x)
+#define setptvalue(L, obj, x)nb_set(obj,(8+1),x)
+#define setobj(L, obj1, obj2){(obj1)->u=(obj2)->u;}
+#define setttype(obj, tt)((obj)->u=((obj)->u&NB_PAYLOAD)|NB_TAG(tt))
+#define iscollectable(o)((o)->u>=NB_TAG(4))
+#define checktag(o, t)((t)==LUA_TNUMBER?nb_isnumber(o):((o)->u>>47)==cast(uint64_t,0x1FFF1+(t)))
+// 数字类型的标签不会被数字使用, 用它存放 47 位有符号整数作为 for 循环的内部槽位
+#define LOOPINT_MAX (cast(lua_Integer,1)<<44)
+#define ttisloopint(o)(((o)->u>>47)==cast(uint64_t,0x1FFF1+LUA_TNUMBER))
+#define loopint(o)cast(lua_Integer,cast(int64_t,(o)->u<<17)>>17)
+#define setloopint(obj, x){TValue*i_o=(obj);i_o->u=NB_TAG(LUA_TNUMBER)|(cast(uint64_t,(x))&NB_PAYLOAD);}
+#define l_isfalse(o)((o)->u==NB_TAG(LUA_TNIL)||(o)->u==NB_TAG(LUA_TBOOLEAN))
+#define NILCONSTANT {NB_TAG(LUA_TNIL)}
+#else
 #define ttype(o)((o)->tt)
-#define ttisnil(o)(ttype(o)==LUA_TNIL)
-#define ttisnumber(o)(ttype(o)==LUA_TNUMBER)
-#define ttisstring(o)(ttype(o)==LUA_TSTRING)
-#define ttistable(o)(ttype(o)==LUA_TTABLE)
-#define ttisfunction(o)(ttype(o)==LUA_TFUNCTION)
-#define ttisboolean(o)(ttype(o)==LUA_TBOOLEAN)
-#define ttisuserdata(o)(ttype(o)==LUA_TUSERDATA)
-#define ttisthread(o)(ttype(o)==LUA_TTHREAD)
-#define ttislightuserdata(o)(ttype(o)==LUA_TLIGHTUSERDATA)
-
 #define gcvalue(o)check_exp(iscollectable(o),(o)->value.gc)
 #define pvalue(o)check_exp(ttislightuserdata(o),(o)->value.p)
 #define nvalue(o)check_exp(ttisnumber(o),(o)->value.n)
 #define rawtsvalue(o)check_exp(ttisstring(o),&(o)->value.gc->ts)
-#define tsvalue(o)(&rawtsvalue(o)->tsv)
 #define rawuvalue(o)check_exp(ttisuserdata(o),&(o)->value.gc->u)
-#define uvalue(o)(&rawuvalue(o)->uv)
 #define clvalue(o)check_exp(ttisfunction(o),&(o)->value.gc->cl)
 #define hvalue(o)check_exp(ttistable(o),&(o)->value.gc->h)
 #define bvalue(o)check_exp(ttisboolean(o),(o)->value.b)
 #define thvalue(o)check_exp(ttisthread(o),&(o)->value.gc->th)
-#define l_isfalse(o)(ttisnil(o)||(ttisboolean(o)&&bvalue(o)==0))
-#define checkconsistency(obj)
-#define checkliveness(g, obj)
 #define setnilvalue(obj)((obj)->tt=LUA_TNIL)
 #define setnvalue(obj, x){TValue*i_o=(obj);i_o->value.n=(x);i_o->tt=3;}
 #define setbvalue(obj, x){TValue*i_o=(obj);i_o->value.b=(x);i_o->tt=1;}
@@ -264,6 +348,30 @@ static void luaG_runerror(lua_State *L, const char *fmt, ...);
 #define setobj(L, obj1, obj2){const TValue*o2=(obj2);TValue*o1=(obj1);o1->value=o2->value;o1->tt=o2->tt;checkliveness(G(L),o1);}
 #define setttype(obj, tt)(ttype(obj)=(tt))
 #define iscollectable(o)(ttype(o)>=4)
+#define checktag(o, t)(ttype(o)==(t))
+// for 循环整数模式的内部槽位, 借用轻量 userdata 的类型: 不可回收, 且伪造的字节码
+// 即使把它读出来当普通值用, 也只是一个轻量 userdata, 不会越界索引类型名或元表数组
+#define LUA_TLOOPINT LUA_TLIGHTUSERDATA
+#define LOOPINT_MAX (cast(lua_Integer,1)<<53)
+#define ttisloopint(o)(ttype(o)==LUA_TLOOPINT)
+#define loopint(o)((o)->value.i)
+#define setloopint(obj, x){TValue*i_o=(obj);i_o->value.i=(x);i_o->tt=LUA_TLOOPINT;}
+#define l_isfalse(o)(ttisnil(o)||(ttisboolean(o)&&bvalue(o)==0))
+#define NILCONSTANT {{NULL},0}
+#endif
+#define ttisnil(o)checktag(o,LUA_TNIL)
+#define ttisnumber(o)checktag(o,LUA_TNUMBER)
+#define ttisstring(o)checktag(o,LUA_TSTRING)
+#define ttistable(o)checktag(o,LUA_TTABLE)
+#define ttisfunction(o)checktag(o,LUA_TFUNCTION)
+#define ttisboolean(o)checktag(o,LUA_TBOOLEAN)
+#define ttisuserdata(o)checktag(o,LUA_TUSERDATA)
+#define ttisthread(o)checktag(o,LUA_TTHREAD)
+#define ttislightuserdata(o)checktag(o,LUA_TLIGHTUSERDATA)
+#define tsvalue(o)(&rawtsvalue(o)->tsv)
+#define uvalue(o)(&rawuvalue(o)->uv)
+#define checkconsistency(obj)
+#define checkliveness(g, obj)
 
 
 #define cast(t, exp)((t)(exp))
@@ -339,9 +447,17 @@ typedef struct Proto {
     struct LocVar *locvars;
     TString **upvalues;
     TString *source;
+    int *cache;         // 指令内联缓存, 与 code 一一对应, 记录字符串键上次命中的节点下标
+#ifdef LUA_USE_JIT
+    void *jit;          // 编译出的本地代码 (mmap 的可执行内存), 未编译时为 NULL
+    size_t sizejit;
+    unsigned int *jitmap;   // 指令下标 -> 本地代码偏移, 大小为 sizecode
+    int hotcount;       // 调用次数与循环回边次数, 达到 JIT_HOTCOUNT 时编译
+#endif
     int sizeupvalues;
     int sizek;
     int sizecode;
+    int sizecache;
     int sizelineinfo;
     int sizep;
     int sizelocvars;
@@ -352,6 +468,7 @@ typedef struct Proto {
     lu_byte numparams;
     lu_byte is_vararg;
     lu_byte maxstacksize;
+    lu_byte mapped;     // code 与 lineinfo 指向字节码映像, 不由本函数释放
 } Proto;
 
 typedef struct LocVar {
@@ -403,12 +520,21 @@ typedef union Closure {
     LClosure l;
 } Closure;
 
+// lua_loadimage 加载的常驻字节码映像
+typedef struct Image {
+    struct Image *next;
+    void *p;
+    size_t size;
+    lua_Release release;
+} Image;
+
 typedef struct global_State {
     StringTable strt;                   // 用于存储字符串的哈希表结构，用于快速查找和管理字符串对象
     lua_Alloc frealloc;                 // 用于内存分配和重新分配的函数指针，可以根据实际需要进行内存管理
     void *userdata;                     // 一个通用的指针，用于存储用户自定义数据，可以在内存分配和重新分配函数中使用
     lu_byte currentwhite;               // 表示当前的垃圾回收状态
     lu_byte gcstate;                    // 表示垃圾回收的状态
+    lu_byte gckind;                     // 回收模式: LUA_GCINC 或 LUA_GCGEN
     int sweepstrgc;                     // 用于记录字符串对象的垃圾回收状态
     GCObject *rootgc;                   // 是一个链表结构，用于管理所有的垃圾回收对象
     GCObject **sweepgc;                 // 指向当前需要进行垃圾回收的对象列表
@@ -423,12 +549,24 @@ typedef struct global_State {
     lu_mem gcdept;                      // 垃圾回收深度
     int gcpause;                        // 垃圾回收暂停
     int gcstepmul;                      // 垃圾回收步进倍数
+    int gcmajorinc;                     // 分代模式下内存比上次大回收后增长多少 (百分比) 时做大回收
+    lu_mem lastmajor;                   // 上次大回收结束时的字节数
+    lu_mem memlimit;                    // 内存上限, 0 表示不限
+    lu_byte gcstopped;                  // lua_gc 停止了自动回收, 只在碰到内存上限时回收
     lua_CFunction panic;                // Lua 运行时的错误处理函数
     TValue l_registry;                  // 注册表，用于存储全局变量等信息
     struct lua_State *mainthread;       // 主线程
     UpVal uvhead;                       // 上值链表的头部
     struct Table *mt[(8 + 1)];          // 用于存储元表的数组
     TString *tmname[TM_N];              // 用于存储元方法名称的数组
+    Image *images;                      // 被 Proto 引用着的字节码映像, 关闭时释放
+    struct MarkPool *markpool;          // 并行标记的线程池, NULL 表示串行标记
+    struct Sweeper *sweeper;            // 后台释放垃圾的线程, NULL 表示在清扫时直接释放
+    char *arenabase;                    // lua_setarena 申请的整块内存, NULL 表示不用竞技场
+    char *arenatop;                     // 下一个块从这里切出来
+    char *arenaend;
+    lua_GCStats gcstats;                // 回收器的计数和计时
+    double gcphaseclock;                // 当前阶段从什么时候开始计时
 } global_State;
 
 struct lua_State {
@@ -460,15 +598,14 @@ struct lua_State {
     GCObject *gclist;                   // 用于管理对象的垃圾回收链表
     struct lua_longjmp *errorJmp;       // 指向错误跳转结构的指针，用于处理错误跳转
     ptrdiff_t errfunc;                  // 表示当前错误处理函数在栈中的位置
+    int nextpos;                        // lua_next 的遍历游标, 用前按键验证, 所以各表共用一个也不会出错
 };
 
-typedef union TKey {
-    struct {
-        Value value;            // 存储键的具体数值。
-        int tt;                 // 类型标记，用于表示键的类型
-        struct Node *next;      // 指向下一个节点的指针，用于在哈希冲突的情况下构成链表
-    } nk;
-    TValue tvk;                 // 作为备用方案，直接存储键的值
+typedef struct TKey {
+    TValue tvk;                 // 键的值
+#ifndef LUA_USE_SWISS
+    struct Node *next;          // 指向下一个节点的指针，用于在哈希冲突的情况下构成链表
+#endif
 } TKey;
 
 typedef struct Node {
@@ -486,9 +623,14 @@ typedef struct Table {
     struct Table *metatable;    // 指向该表的元表（metatable）
     TValue *array;              // 指向存储数组部分的指针
     Node *node;                 // 指向存储哈希部分节点的指针
+#ifdef LUA_USE_SWISS
+    int growth;                 // 开放寻址时还能占用的空槽数, 用完就 rehash
+#else
     Node *lastfree;             // 指向最后一个空闲节点的指针，用于快速分配新节点
+#endif
     GCObject *gclist;           // 指向下一个待回收对象的指针，用于构成待回收对象链表
     int sizearray;              // 表示数组部分的大小
+    int border;                 // 上一次 # 求出的边界, 只作提示, 用前先验证
 } Table;
 
 union GCObject {
@@ -508,6 +650,7 @@ struct Zio {
     lua_Reader reader;
     void *data;
     lua_State *L;
+    int mapped;     // 数据来自 lua_loadimage 的常驻映像, 可以被 Proto 直接引用
 };
 
 #define luaZ_initbuffer(L, buff)((buff)->buffer=NULL,(buff)->buffsize=0)
@@ -573,13 +716,58 @@ static void *luaM_toobig(lua_State *L) {
     return NULL;
 }
 
+#define arenaround(n)(((n)+15)&~(size_t)15)
+#define inarena(g, p)((char*)(p)>=(g)->arenabase&&(char*)(p)<(g)->arenaend)
+
+// 竞技场里只移动 arenatop: 释放和缩小都不归还内存, 只有最顶上的块能原地伸缩;
+// 竞技场用完后改由 frealloc 分配, 并重新打开垃圾回收来管理溢出的这部分内存
+static void *arena_realloc(global_State *g, void *block, size_t oldSize, size_t newSize) {
+    char *b = (char *) block;
+    char *n;
+    if (b != NULL && b + arenaround(oldSize) == g->arenatop &&
+        arenaround(newSize) <= (size_t) (g->arenaend - b)) {
+        g->arenatop = b + arenaround(newSize);
+        return newSize ? b : NULL;
+    }
+    if (newSize <= oldSize)
+        return newSize ? b : NULL;
+    if (arenaround(newSize) <= (size_t) (g->arenaend - g->arenatop)) {
+        n = g->arenatop;
+        g->arenatop += arenaround(newSize);
+    } else {
+        if (g->arenatop != g->arenaend) {
+            g->arenatop = g->arenaend;
+            g->GCthreshold = g->totalbytes;
+        }
+        n = (char *) (*g->frealloc)(g->userdata, NULL, 0, newSize);
+        if (n == NULL)
+            return NULL;
+    }
+    if (b != NULL)
+        memcpy(n, b, oldSize);
+    return n;
+}
+
+static void *dorealloc(global_State *g, void *block, size_t oldSize, size_t newSize) {
+    if (g->arenabase != NULL && (block == NULL || inarena(g, block)))
+        return arena_realloc(g, block, oldSize, newSize);
+    return (*g->frealloc)(g->userdata, block, oldSize, newSize);
+}
+
 static void *luaM_realloc_(lua_State *L, void *block, size_t oldSize, size_t newSize) {
     global_State *g = G(L);
-    block = (*g->frealloc)(g->userdata, block, oldSize, newSize);
-    if (block == NULL && newSize > 0)
+    void *b = dorealloc(g, block, oldSize, newSize);
+#ifdef LUA_USE_BGSWEEP
+    // 后台线程手里可能还压着没还给分配器的垃圾, 等它全部释放后再试一次
+    if (b == NULL && newSize > 0 && g->sweeper != NULL) {
+        bg_drain(L);
+        b = dorealloc(g, block, oldSize, newSize);
+    }
+#endif
+    if (b == NULL && newSize > 0)
         luaD_throw(L, 4);
     g->totalbytes = (g->totalbytes - oldSize) + newSize;
-    return block;
+    return b;
 }
 
 #define resetbits(x, m)((x)&=cast(lu_byte,~(m)))
@@ -600,6 +788,7 @@ static void *luaM_realloc_(lua_State *L, void *block, size_t oldSize, size_t new
 #define isdead(g, v)((v)->gch.marked&otherwhite(g)&bit2mask(0,1))
 #define changewhite(x)((x)->gch.marked^=bit2mask(0,1))
 #define gray2black(x)l_setbit((x)->gch.marked,2)
+#define isold(x)testbit((x)->gch.marked,7)
 #define valiswhite(x)(iscollectable(x)&&iswhite(gcvalue(x)))
 #define luaC_white(g)cast(lu_byte,(g)->currentwhite&bit2mask(0,1))
 #define luaC_checkGC(L){condhardstacktests(luaD_reallocstack(L,L->stacksize-5-1));if(G(L)->totalbytes>=G(L)->GCthreshold)luaC_step(L);}
@@ -638,9 +827,30 @@ static int luaV_tostring(lua_State *L, StkId obj);
 
 static void luaV_execute(lua_State *L, int nexeccalls);
 
+#ifdef LUA_USE_JIT
+#ifndef JIT_HOTCOUNT
+#define JIT_HOTCOUNT 64
+#endif
+// 本地代码与辅助函数交还给 luaV_execute 的状态
+enum {
+    JIT_CONTINUE,       // 继续执行本地代码
+    JIT_CALL,           // 进入了新的 Lua 函数
+    JIT_TAILCALL,       // 尾调用替换了当前函数
+    JIT_RETURN,         // 当前函数已返回
+    JIT_RETURNTOP,      // 当前函数已返回, 且调用者需要恢复 L->top
+    JIT_YIELD           // C 函数让出了协程
+};
+
+static void luaJ_compile(lua_State *L, Proto *p);
+
+static void luaJ_free(lua_State *L, Proto *p);
+
+static int luaJ_run(lua_State *L, LClosure *cl, const Instruction *pc);
+#endif
+
 static void luaV_concat(lua_State *L, int total, int last);
 
-static const TValue luaO_nilObject_ = {{NULL}, 0};
+static const TValue luaO_nilObject_ = NILCONSTANT;
 
 static int luaO_int2fb(unsigned int x) {
     int e = 0;
@@ -815,9 +1025,11 @@ static void luaO_chunkid(char *out, const char *source, size_t bufflen) {
 }
 
 #define gnode(t, i)(&(t)->node[i])
-#define gkey(n)(&(n)->i_key.nk)
+#define gkey(n)(&(n)->i_key.tvk)
 #define gval(n)(&(n)->i_val)
-#define gnext(n)((n)->i_key.nk.next)
+#ifndef LUA_USE_SWISS
+#define gnext(n)((n)->i_key.next)
+#endif
 #define key2tval(n)(&(n)->i_key.tvk)
 
 static TValue *luaH_setnum(lua_State *L, Table *t, int key);
@@ -961,6 +1173,14 @@ static Proto *luaF_newproto(lua_State *L) {
     f->sizep = 0;
     f->code = NULL;
     f->sizecode = 0;
+    f->cache = NULL;
+    f->sizecache = 0;
+#ifdef LUA_USE_JIT
+    f->jit = NULL;
+    f->sizejit = 0;
+    f->jitmap = NULL;
+    f->hotcount = 0;
+#endif
     f->sizelineinfo = 0;
     f->sizeupvalues = 0;
     f->nups = 0;
@@ -968,6 +1188,7 @@ static Proto *luaF_newproto(lua_State *L) {
     f->numparams = 0;
     f->is_vararg = 0;
     f->maxstacksize = 0;
+    f->mapped = 0;
     f->lineinfo = NULL;
     f->sizelocvars = 0;
     f->locvars = NULL;
@@ -978,10 +1199,16 @@ static Proto *luaF_newproto(lua_State *L) {
 }
 
 static void luaF_freeproto(lua_State *L, Proto *f) {
-    luaM_freearray(L, f->code, f->sizecode, Instruction);
+#ifdef LUA_USE_JIT
+    luaJ_free(L, f);
+#endif
+    if (!f->mapped) {
+        luaM_freearray(L, f->code, f->sizecode, Instruction);
+        luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
+    }
+    luaM_freearray(L, f->cache, f->sizecache, int);
     luaM_freearray(L, f->p, f->sizep, Proto*);
     luaM_freearray(L, f->k, f->sizek, TValue);
-    luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
     luaM_freearray(L, f->locvars, f->sizelocvars, struct LocVar);
     luaM_freearray(L, f->upvalues, f->sizeupvalues, TString*);
     luaM_free(L, f);
@@ -1012,10 +1239,27 @@ static void luaF_freeclosure(lua_State *L, Closure *c) {
 #define ISK(x)((x)&(1<<(9-1)))
 #define INDEXK(r)((int)(r)&~(1<<(9-1)))
 #define RKASK(x)((x)|(1<<(9-1)))
-static const lu_byte luaP_opmodes[(cast(int, OP_VARARG) + 1)];
+static const lu_byte luaP_opmodes[NUM_OPCODES];
 #define getBMode(m)(cast(enum OpArgMask,(luaP_opmodes[m]>>4)&3))
 #define getCMode(m)(cast(enum OpArgMask,(luaP_opmodes[m]>>2)&3))
 #define testTMode(m)(luaP_opmodes[m]&(1<<7))
+
+// 为按字符串键访问表的指令分配内联缓存槽, 没有这类指令的函数不分配.
+// 相同键序列、相同大小构造出来的表, 同一个键总落在同一个节点下标上,
+// 所以一个槽就能在同"形状"的所有记录之间共享, 守卫只是比较一次键指针
+static void luaF_initcache(lua_State *L, Proto *f) {
+    int pc;
+    for (pc = 0; pc < f->sizecode; pc++) {
+        OpCode op = GET_OPCODE(f->code[pc]);
+        if (op == OP_GETGLOBAL || op == OP_SETGLOBAL || op == OP_GETFIELD ||
+            op == OP_SELF || op == OP_SETTABLE)
+            break;
+    }
+    if (pc == f->sizecode) return;
+    f->cache = luaM_newvector(L, f->sizecode, int);
+    f->sizecache = f->sizecode;
+    for (pc = 0; pc < f->sizecache; pc++) f->cache[pc] = 0;
+}
 typedef struct expdesc {
     expkind k;
     union {
@@ -1052,6 +1296,8 @@ typedef struct FuncState {
 } FuncState;
 
 static Proto *luaY_parser(lua_State *L, ZIO *z, MBuffer *buff, const char *name);
+static Proto *luaU_undump(lua_State *L, ZIO *Z, MBuffer *buff, const char *name);
+static int luaZ_lookahead(ZIO *z);
 
 // 在上下文中，volatile int status; 的使用可能是因为 status 变量会在长跳转的处理过程中被修改，
 // 而且这种修改是由程序执行流之外的因素所导致的，比如在异常处理时。
@@ -1220,6 +1466,9 @@ static int luaD_precall(lua_State *L, StkId func, int nResults) {
         CallInfo *ci;
         StkId st, base;
         Proto *p = cl->p;
+#ifdef LUA_USE_JIT
+        if (p->jit == NULL && ++p->hotcount == JIT_HOTCOUNT)luaJ_compile(L, p);
+#endif
         luaD_checkstack(L, p->maxstacksize + p->numparams);
         func = restorestack(L, funcr);
         if (!p->is_vararg) {
@@ -1324,9 +1573,10 @@ static void f_parser(lua_State *L, void *ud) {
     Proto *tf;
     Closure *cl;
     struct SParser *p = cast(struct SParser*, ud);
+    int c = luaZ_lookahead(p->z);
     luaC_checkGC(L);
-    tf = luaY_parser(L, p->z,
-                     &p->buff, p->name);
+    tf = ((c == LUA_SIGNATURE[0]) ? luaU_undump : luaY_parser)(L, p->z,
+                                                              &p->buff, p->name);
     cl = luaF_newLclosure(L, tf->nups, hvalue(gt(L)));
     cl->l.p = tf;
     for (i = 0; i < tf->nups; i++)
@@ -1354,15 +1604,22 @@ static void luaS_resize(lua_State *L, int newSize) {
     newHash = luaM_newvector(L, newSize, GCObject*);
     tb = &G(L)->strt;
     for (int i = 0; i < newSize; i++)newHash[i] = NULL;
-    for (int i = 0; i < tb->size; i++) {
-        GCObject *p = tb->hash[i];
-        while (p) {
-            GCObject *next = p->gch.next;
-            unsigned int h = gco2ts(p)->hash;
-            int h1 = lmod(h, newSize);
-            p->gch.next = newHash[h1];
-            newHash[h1] = p;
-            p = next;
+    // 先插老字符串再插新字符串, 让每条链上新字符串都排在前面, 分代模式的清扫遇到老字符串就可以停下
+    for (int old = 1; old >= 0; old--) {
+        for (int i = 0; i < tb->size; i++) {
+            GCObject **pp = &tb->hash[i];
+            GCObject *p;
+            while ((p = *pp) != NULL) {
+                unsigned int h = gco2ts(p)->hash;
+                int h1 = lmod(h, newSize);
+                if ((isold(p) != 0) != old) {
+                    pp = &p->gch.next;
+                    continue;
+                }
+                *pp = p->gch.next;
+                p->gch.next = newHash[h1];
+                newHash[h1] = p;
+            }
         }
     }
     luaM_freearray(L, tb->hash, tb->size, TString*);
@@ -1427,14 +1684,112 @@ static Udata *luaS_newudata(lua_State *L, size_t s, Table *e) {
     return u;
 }
 
+#ifdef LUA_USE_SWISS
+
+// 开放寻址的哈希部分 (Swiss table 的布局): Node 数组后面紧跟 sizenode+16 个控制字节, 一个槽一个.
+// SW_EMPTY 表示空槽, 否则是键哈希的高 7 位; 查找时一次比较 16 个控制字节, 只有字节相同的槽才去比较键.
+// 最后 16 个字节是开头的镜像, 从任何位置都能整组读取. 键放进去以后直到 rehash 都不会移走,
+// 值为 nil 的槽仍然占着位置, 所以没有墓碑; 空槽总留下至少一个, 探测一定能停下来
+#define SW_GROUP 16
+#define SW_EMPTY 0x80
+#define gctrl(t)((lu_byte*)((t)->node+sizenode(t)))
+#define nodevecsize(n)((size_t)(n)*sizeof(Node)+(n)+SW_GROUP)
+#define sw_maxload(n)((n)-((n)>>3)-1)
+#define sw_h2(h)cast_byte((h)>>25)
+
+static const struct {
+    Node node;
+    lu_byte ctrl[1 + SW_GROUP];
+} dummyswiss_ = {
+        {NILCONSTANT, {NILCONSTANT}},
+        {SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY,
+         SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY, SW_EMPTY}
+};
+#define dummynode_ (dummyswiss_.node)
+
+// 16 个控制字节里等于 b 的那些, 按位返回
+static unsigned int sw_match(const lu_byte *c, lu_byte b) {
+#ifdef __SSE2__
+    return (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) c),
+                                                           _mm_set1_epi8((char) b)));
+#else
+    unsigned int m = 0;
+    int i;
+    for (i = 0; i < SW_GROUP; i++)
+        if (c[i] == b) m |= 1u << i;
+    return m;
+#endif
+}
+
+#ifdef __GNUC__
+#define sw_ctz(x)__builtin_ctz(x)
+#else
+static int sw_ctz(unsigned int x) {
+    int i = 0;
+    while (!(x & 1)) x >>= 1, i++;
+    return i;
+}
+#endif
+
+// 把 Lua 原来按类型取的哈希值打散, 指针和小整数的低位规律太强
+static unsigned int sw_mix(unsigned int h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static unsigned int sw_hashnum(lua_Number n) {
+    unsigned int a[cast_int(sizeof(lua_Number) / sizeof(int))];
+    int i;
+    if (luai_numeq(n, 0))
+        return 0;
+    memcpy(a, &n, sizeof(a));
+    for (i = 1; i < cast_int(sizeof(lua_Number) / sizeof(int)); i++)a[0] += a[i];
+    return sw_mix(a[0]);
+}
+
+static unsigned int sw_hash(const TValue *key) {
+    switch (ttype(key)) {
+        case 3:
+            return sw_hashnum(nvalue(key));
+        case 4:
+            return sw_mix(rawtsvalue(key)->tsv.hash);
+        case 1:
+            return sw_mix(bvalue(key));
+        case 2:
+            return sw_mix(IntPoint(pvalue(key)));
+        default:
+            return sw_mix(IntPoint(gcvalue(key)));
+    }
+}
+
+// 沿探测序列逐组查找哈希为 h 且满足 eq 的槽, 结果放在 n 里; 碰到带空槽的组说明键不在表里, n 为 NULL
+#define sw_find(t, h, n, eq){const lu_byte*c_=gctrl(t);unsigned int m_=sizenode(t)-1,p_=(h)&m_,s_=0,b_;\
+for(;;){for(b_=sw_match(c_+p_,sw_h2(h));b_!=0;b_&=b_-1){(n)=gnode(t,(p_+sw_ctz(b_))&m_);if(eq){break;}}\
+if(b_!=0){break;}if(sw_match(c_+p_,SW_EMPTY)){(n)=NULL;break;}s_+=SW_GROUP;p_=(p_+s_)&m_;}}
+
+static void sw_setctrl(Table *t, unsigned int i, lu_byte b) {
+    lu_byte *c = gctrl(t);
+    unsigned int n = sizenode(t);
+    c[i] = b;
+    for (i += n; i < n + SW_GROUP; i += n)
+        c[i] = b;
+}
+
+#else
+
+#define nodevecsize(n)((size_t)(n)*sizeof(Node))
 #define hashpow2(t, n)(gnode(t,lmod((n),sizenode(t))))
 #define hashstr(t, str)hashpow2(t,(str)->tsv.hash)
 #define hashboolean(t, p)hashpow2(t,p)
 #define hashmod(t, n)(gnode(t,((n)%((sizenode(t)-1)|1))))
 #define hashpointer(t, p)hashmod(t,IntPoint(p))
 static const Node dummynode_ = {
-        {{NULL}, 0},
-        {{{NULL}, 0, NULL}}
+        NILCONSTANT,
+        {NILCONSTANT, NULL}
 };
 
 static Node *hashnum(const Table *t, lua_Number n) {
@@ -1462,6 +1817,8 @@ static Node *mainposition(const Table *t, const TValue *key) {
     }
 }
 
+#endif
+
 static int arrayindex(const TValue *key) {
     if (ttisnumber(key)) {
         lua_Number n = nvalue(key);
@@ -1473,6 +1830,10 @@ static int arrayindex(const TValue *key) {
     return -1;
 }
 
+// 节点 n 上的键是否就是 key; 遍历中被置 nil 并回收过的键已变成死键, 按指针比对
+#define samekey(n, key)(luaO_rawEqualObj(key2tval(n), key) || \
+    (ttype(gkey(n)) == (8 + 3) && iscollectable(key) && gcvalue(gkey(n)) == gcvalue(key)))
+
 static int findindex(lua_State *L, Table *t, StkId key) {
     int i;
     if (ttisnil(key))return -1;
@@ -1480,26 +1841,42 @@ static int findindex(lua_State *L, Table *t, StkId key) {
     if (0 < i && i <= t->sizearray)
         return i - 1;
     else {
+#ifdef LUA_USE_SWISS
+        Node *n;
+        unsigned int h = sw_hash(key);
+        sw_find(t, h, n, samekey(n, key));
+        if (n != NULL)
+            return cast_int(n - gnode(t, 0)) + t->sizearray;
+#else
         Node *n = mainposition(t, key);
         do {
-            if (luaO_rawEqualObj(key2tval(n), key) ||
-                (ttype(gkey(n)) == (8 + 3) && iscollectable(key) &&
-                 gcvalue(gkey(n)) == gcvalue(key))) {
+            if (samekey(n, key)) {
                 i = cast_int(n - gnode(t, 0));
                 return i + t->sizearray;
             } else n = gnext(n);
         } while (n);
+#endif
         luaG_runerror(L, "invalid key to "LUA_QL("next"));
         return 0;
     }
 }
 
-static int luaH_next(lua_State *L, Table *t, StkId key) {
-    int i = findindex(L, t, key);
+// pos 非空时是遍历游标: 记录上一次返回的项的下标 +1. 该位置上仍是 key 时直接往后扫,
+// 否则 (首次调用、表已 rehash、调用方换了键) 退回 findindex, 所以游标过期也不会出错
+static int luaH_next(lua_State *L, Table *t, StkId key, int *pos) {
+    int i = -1;
+    if (pos != NULL && *pos > 0 && !ttisnil(key)) {
+        i = *pos - 1;
+        if (i < t->sizearray ? !(ttisnumber(key) && nvalue(key) == cast_num(i + 1))
+                             : (i - t->sizearray >= (int) sizenode(t) || !samekey(gnode(t, i - t->sizearray), key)))
+            i = -1;
+    }
+    if (i < 0) i = findindex(L, t, key);
     for (i++; i < t->sizearray; i++) {
         if (!ttisnil(&t->array[i])) {
             setnvalue(key, cast_num(i + 1));
             setobj(L, key + 1, &t->array[i]);
+            if (pos != NULL) *pos = i + 1;
             return 1;
         }
     }
@@ -1507,6 +1884,7 @@ static int luaH_next(lua_State *L, Table *t, StkId key) {
         if (!ttisnil(gval(gnode(t, i)))) {
             setobj(L, key, key2tval(gnode(t, i)));
             setobj(L, key + 1, gval(gnode(t, i)));
+            if (pos != NULL) *pos = i + t->sizearray + 1;
             return 1;
         }
     }
@@ -1596,19 +1974,32 @@ static void setNodeVector(lua_State *L, Table *t, int size) {
         t->node = cast(Node*, (&dummynode_));
     } else {
         lsize = ceil_log2(size);
+#ifdef LUA_USE_SWISS
+        // 要留出空槽, 装满 size 个键时负载不超过 7/8
+        while ((int) sw_maxload(twoto(lsize)) < size)
+            lsize++;
+#endif
         if (lsize > (32 - 2))
             luaG_runerror(L, "table overflow");
         size = twoto(lsize);
-        t->node = luaM_newvector(L, size, Node);
+        t->node = cast(Node*, luaM_malloc(L, nodevecsize(size)));
         for (int i = 0; i < size; i++) {
             Node *n = gnode(t, i);
+#ifndef LUA_USE_SWISS
             gnext(n) = NULL;
+#endif
             setnilvalue(gkey(n));
             setnilvalue(gval(n));
         }
     }
     t->lsizenode = cast_byte(lsize);
+#ifdef LUA_USE_SWISS
+    if (size > 0)
+        memset(gctrl(t), SW_EMPTY, size + SW_GROUP);
+    t->growth = size > 0 ? (int) sw_maxload(size) : 0;
+#else
     t->lastfree = gnode(t, size);
+#endif
 }
 
 static void resize(lua_State *L, Table *t, int nasize, int nhsize) {
@@ -1631,11 +2022,15 @@ static void resize(lua_State *L, Table *t, int nasize, int nhsize) {
         if (!ttisnil(gval(old))) setobj(L, luaH_set(L, t, key2tval(old)), gval(old));
     }
     if (nold != (&dummynode_))
-        luaM_freearray(L, nold, twoto(oldhsize), Node);
+        luaM_freemem(L, nold, nodevecsize(twoto(oldhsize)));
 }
 
 static void luaH_resizearray(lua_State *L, Table *t, int nasize) {
+#ifdef LUA_USE_SWISS
+    int nsize = (t->node == (&dummynode_)) ? 0 : (int) sw_maxload(sizenode(t));
+#else
     int nsize = (t->node == (&dummynode_)) ? 0 : sizenode(t);
+#endif
     resize(L, t, nasize, nsize);
 }
 
@@ -1663,6 +2058,7 @@ static Table *luaH_new(lua_State *L, int nArray, int nHash) {
     t->array = NULL;
     t->sizearray = 0;
     t->lsizenode = 0;
+    t->border = 0;
     t->node = cast(Node*, (&dummynode_));
     setArrayVector(L, t, nArray);
     setNodeVector(L, t, nHash);
@@ -1671,11 +2067,99 @@ static Table *luaH_new(lua_State *L, int nArray, int nHash) {
 
 static void luaH_free(lua_State *L, Table *t) {
     if (t->node != (&dummynode_))
-        luaM_freearray(L, t->node, sizenode(t), Node);
+        luaM_freemem(L, t->node, nodevecsize(sizenode(t)));
     luaM_freearray(L, t->array, t->sizearray, TValue);
     luaM_free(L, t);
 }
 
+// 清空表的内容, 但保留 array 和 node 的存储, 重新填入同样多的元素时不会再 rehash
+static void luaH_clear(Table *t) {
+    int i;
+    for (i = 0; i < t->sizearray; i++)
+        setnilvalue(&t->array[i]);
+    t->border = 0;
+    if (t->node == (&dummynode_))
+        return;
+    for (i = 0; i < (int) sizenode(t); i++) {
+        Node *n = gnode(t, i);
+#ifndef LUA_USE_SWISS
+        gnext(n) = NULL;
+#endif
+        setnilvalue(gkey(n));
+        setnilvalue(gval(n));
+    }
+#ifdef LUA_USE_SWISS
+    memset(gctrl(t), SW_EMPTY, sizenode(t) + SW_GROUP);
+    t->growth = (int) sw_maxload(sizenode(t));
+#else
+    t->lastfree = gnode(t, sizenode(t));
+#endif
+}
+
+#ifdef LUA_USE_SWISS
+
+// 新键放进探测序列上的第一个空槽; 空槽用完就 rehash, 和 getfreepos 找不到空节点时一样
+static TValue *newkey(lua_State *L, Table *t, const TValue *key) {
+    unsigned int h = sw_hash(key);
+    const lu_byte *c = gctrl(t);
+    unsigned int m = sizenode(t) - 1, p = h & m, s = 0, b;
+    Node *n;
+    if (t->growth == 0) {
+        rehash(L, t, key);
+        return luaH_set(L, t, key);
+    }
+    while ((b = sw_match(c + p, SW_EMPTY)) == 0) {
+        s += SW_GROUP;
+        p = (p + s) & m;
+    }
+    p = (p + sw_ctz(b)) & m;
+    sw_setctrl(t, p, sw_h2(h));
+    t->growth--;
+    n = gnode(t, p);
+    setobj(L, gkey(n), key);
+    luaC_barriert(L, t, key);
+    return gval(n);
+}
+
+static const TValue *luaH_getnum(Table *t, int key) {
+    if (cast(unsigned int, key) - 1 < cast(unsigned int, t->sizearray))
+        return &t->array[key - 1];
+    else {
+        lua_Number nk = cast_num(key);
+        unsigned int h = sw_hashnum(nk);
+        Node *n;
+        sw_find(t, h, n, ttisnumber(gkey(n)) && luai_numeq(nvalue(gkey(n)), nk));
+        return n ? gval(n) : (&luaO_nilObject_);
+    }
+}
+
+static const TValue *luaH_getstr(Table *t, TString *key) {
+    unsigned int h = sw_mix(key->tsv.hash);
+    Node *n;
+    sw_find(t, h, n, ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key);
+    return n ? gval(n) : (&luaO_nilObject_);
+}
+
+// 带缓存的字符串键查找: *slot 先当作节点下标直接比对, 不命中再探测并回填;
+// 下标越界或槽里换了别的键都只会导致不命中, 因此表扩容后缓存无需失效
+static TValue *luaH_getstrcached(Table *t, TString *key, int *slot) {
+    unsigned int h;
+    Node *n;
+    if ((unsigned int) *slot < (unsigned int) sizenode(t)) {
+        n = gnode(t, *slot);
+        if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key)
+            return gval(n);
+    }
+    h = sw_mix(key->tsv.hash);
+    sw_find(t, h, n, ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key);
+    if (n == NULL)
+        return NULL;
+    *slot = cast_int(n - t->node);
+    return gval(n);
+}
+
+#else
+
 static Node *getfreepos(Table *t) {
     while (t->lastfree-- > t->node) {
         if (ttisnil(gkey(t->lastfree)))
@@ -1706,8 +2190,7 @@ static TValue *newkey(lua_State *L, Table *t, const TValue *key) {
             mp = n;
         }
     }
-    gkey(mp)->value = key->value;
-    gkey(mp)->tt = key->tt;
+    setobj(L, gkey(mp), key);
     luaC_barriert(L, t, key);
     return gval(mp);
 }
@@ -1737,6 +2220,27 @@ static const TValue *luaH_getstr(Table *t, TString *key) {
     return (&luaO_nilObject_);
 }
 
+// 带缓存的字符串键查找: *slot 先当作节点下标直接比对, 不命中再走哈希链并回填;
+// 下标越界或节点里换了别的键都只会导致不命中, 因此表扩容或节点搬移后缓存无需失效
+static TValue *luaH_getstrcached(Table *t, TString *key, int *slot) {
+    Node *n;
+    if ((unsigned int) *slot < (unsigned int) sizenode(t)) {
+        n = gnode(t, *slot);
+        if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key)
+            return gval(n);
+    }
+    n = hashstr(t, key);
+    do {
+        if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key) {
+            *slot = cast_int(n - t->node);
+            return gval(n);
+        } else n = gnext(n);
+    } while (n);
+    return NULL;
+}
+
+#endif
+
 static const TValue *luaH_get(Table *t, const TValue *key) {
     switch (ttype(key)) {
         case 0:
@@ -1752,6 +2256,12 @@ static const TValue *luaH_get(Table *t, const TValue *key) {
         }
 /*fallthrough*/
         default: {
+#ifdef LUA_USE_SWISS
+            unsigned int h = sw_hash(key);
+            Node *n;
+            sw_find(t, h, n, luaO_rawEqualObj(key2tval(n), key));
+            return n ? gval(n) : (&luaO_nilObject_);
+#else
             Node *n = mainposition(t, key);
             do {
                 if (luaO_rawEqualObj(key2tval(n), key))
@@ -1759,6 +2269,7 @@ static const TValue *luaH_get(Table *t, const TValue *key) {
                 else n = gnext(n);
             } while (n);
             return (&luaO_nilObject_);
+#endif
         }
     }
 }
@@ -1818,7 +2329,7 @@ static int unbound_search(Table *t, unsigned int j) {
     return i;
 }
 
-static int luaH_getn(Table *t) {
+static int findborder(Table *t) {
     unsigned int j = t->sizearray;
     if (j > 0 && ttisnil(&t->array[j - 1])) {
         unsigned int i = 0;
@@ -1833,7 +2344,21 @@ static int luaH_getn(Table *t) {
     else return unbound_search(t, j);
 }
 
-#define makewhite(g, x)((x)->gch.marked=cast_byte(((x)->gch.marked&cast_byte(~(bitmask(2)|bit2mask(0,1))))|luaC_white(g)))
+// 先验证缓存的边界, t[#t+1]=v 和 t[#t]=nil 只让边界移动一格, 也顺带检查;
+// 提示过期只会多走一次 findborder, 所以写表的各条路径 (VM, JIT, API) 都不必维护它
+static int luaH_getn(Table *t) {
+    int b = t->border;
+    if (ttisnil(luaH_getnum(t, b + 1))) {
+        if (b == 0 || !ttisnil(luaH_getnum(t, b)))
+            return b;
+        if (b == 1 || !ttisnil(luaH_getnum(t, b - 1)))
+            return t->border = b - 1;
+    } else if (ttisnil(luaH_getnum(t, b + 2)))
+        return t->border = b + 1;
+    return t->border = findborder(t);
+}
+
+#define makewhite(g, x)((x)->gch.marked=cast_byte(((x)->gch.marked&cast_byte(~(bitmask(7)|bitmask(2)|bit2mask(0,1))))|luaC_white(g)))
 #define white2gray(x)reset2bits((x)->gch.marked,0,1)
 #define black2gray(x)resetbit((x)->gch.marked,2)
 #define stringmark(s)reset2bits((s)->tsv.marked,0,1)
@@ -1841,7 +2366,13 @@ static int luaH_getn(Table *t) {
 #define markfinalized(u)l_setbit((u)->marked,3)
 #define markvalue(g, o){checkconsistency(o);if(iscollectable(o)&&iswhite(gcvalue(o)))reallymarkobject(g,gcvalue(o));}
 #define markobject(g, t){if(iswhite(obj2gco(t)))reallymarkobject(g,obj2gco(t));}
-#define setthreshold(g)(g->GCthreshold=(g->estimate/100)*g->gcpause)
+// 设了内存上限时阈值不超过上限, 这样到达上限前一定会经过 luaC_step 做紧急回收
+static void setthreshold(global_State *g) {
+    lu_mem t = g->gcstopped ? ((lu_mem) (~(lu_mem) 0) - 2) : (g->estimate / 100) * g->gcpause;
+    if (g->memlimit != 0 && t > g->memlimit)
+        t = g->memlimit;
+    g->GCthreshold = t;
+}
 
 static void removeentry(Node *n) {
     if (iscollectable(gkey(n)))
@@ -1850,6 +2381,7 @@ static void removeentry(Node *n) {
 
 static void reallymarkobject(global_State *g, GCObject *o) {
     white2gray(o);
+    g->gcstats.marked++;
     switch (o->gch.tt) {
         case 4: {
             return;
@@ -2057,6 +2589,7 @@ static l_mem propagatemark(global_State *g) {
             g->gray = p->gclist;
             traverseproto(g, p);
             return sizeof(Proto) + sizeof(Instruction) * p->sizecode +
+                   sizeof(int) * p->sizecache +
                    sizeof(Proto *) * p->sizep +
                    sizeof(TValue) * p->sizek +
                    sizeof(int) * p->sizelineinfo +
@@ -2068,8 +2601,401 @@ static l_mem propagatemark(global_State *g) {
     }
 }
 
+#ifdef LUA_USE_PARMARK
+
+#define PM_DEQUE 4096               // 每个标记线程可被窃取的双端队列容量, 必须是 2 的幂
+#define PM_MAXWORKERS 16
+#define PM_MINHEAP (4u<<20)         // 堆比这小时唤醒线程不划算, 仍然串行标记
+
+// Chase-Lev 工作窃取队列: 所有者在 bottom 端压入弹出, 其他线程在 top 端窃取.
+// 满了以后放进只有所有者能用的溢出链表 (借用对象的 gclist, 不用分配内存)
+typedef struct MarkDeque {
+    long top;
+    long bottom;
+    GCObject *buf[PM_DEQUE];
+    GCObject *spill;
+    GCObject *weak;                 // 遍历到的弱表, 结束后并入 g->weak
+    GCObject *threads;              // 线程要在主线程上串行遍历
+    size_t work;
+    unsigned long marked;
+    struct MarkPool *pool;
+    int id;
+} MarkDeque;
+
+typedef struct MarkPool {
+    global_State *g;
+    int n;                          // 参与标记的线程数, 包括调用者自己
+    int size;                       // dq 分配的个数, 线程创建失败时会比 n 多
+    int idle;                       // 没有活可干的线程数, 等于 n 时标记结束
+    unsigned gen;
+    int finished;
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_t tid[PM_MAXWORKERS];
+    MarkDeque dq[1];
+} MarkPool;
+
+#define pm_marked(o)__atomic_load_n(&(o)->gch.marked,__ATOMIC_RELAXED)
+#define pm_setbits(o, m)__atomic_fetch_or(&(o)->gch.marked,cast_byte(m),__ATOMIC_RELAXED)
+#define pm_resetbits(o, m)__atomic_fetch_and(&(o)->gch.marked,cast_byte(~(m)),__ATOMIC_RELAXED)
+#define pm_markvalue(d, o){if(iscollectable(o))pm_markobject(d,gcvalue(o));}
+
+static GCObject **gclistof(GCObject *o) {
+    switch (o->gch.tt) {
+        case 5:
+            return &gco2h(o)->gclist;
+        case 6:
+            return &gco2cl(o)->c.gclist;
+        case 8:
+            return &gco2th(o)->gclist;
+        default:
+            return &gco2p(o)->gclist;
+    }
+}
+
+static void pm_push(MarkDeque *d, GCObject *o) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= PM_DEQUE) {
+        *gclistof(o) = d->spill;
+        d->spill = o;
+        return;
+    }
+    __atomic_store_n(&d->buf[b & (PM_DEQUE - 1)], o, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+static GCObject *pm_take(MarkDeque *d) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    GCObject *o = NULL;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (t <= b) {
+        o = __atomic_load_n(&d->buf[b & (PM_DEQUE - 1)], __ATOMIC_RELAXED);
+        if (t == b) {
+            if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                o = NULL;
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    } else
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    if (o == NULL && d->spill != NULL) {
+        // 队列空了: 从溢出链表搬一半回队列, 让别的线程也能偷到
+        int i;
+        o = d->spill;
+        d->spill = *gclistof(o);
+        for (i = 0; i < PM_DEQUE / 2 && d->spill != NULL; i++) {
+            GCObject *s = d->spill;
+            d->spill = *gclistof(s);
+            pm_push(d, s);
+        }
+    }
+    return o;
+}
+
+static GCObject *pm_steal(MarkDeque *d) {
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    long b;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t < b) {
+        GCObject *o = __atomic_load_n(&d->buf[t & (PM_DEQUE - 1)], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return o;
+    }
+    return NULL;
+}
+
+// 与 reallymarkobject 相同, 只是用原子操作抢到白色对象, 抢到的线程负责遍历它
+static void pm_markobject(MarkDeque *d, GCObject *o) {
+    if (!(pm_marked(o) & bit2mask(0, 1)))
+        return;
+    if (!(pm_resetbits(o, bit2mask(0, 1)) & bit2mask(0, 1)))
+        return;
+    d->marked++;
+    switch (o->gch.tt) {
+        case 4:
+            return;
+        case 7: {
+            Table *mt = gco2u(o)->metatable;
+            pm_setbits(o, bitmask(2));
+            if (mt) pm_markobject(d, obj2gco(mt));
+            pm_markobject(d, obj2gco(gco2u(o)->env));
+            return;
+        }
+        case (8 + 2): {
+            UpVal *uv = gco2uv(o);
+            pm_markvalue(d, uv->v);
+            if (uv->v == &uv->u.value)
+                pm_setbits(o, bitmask(2));
+            return;
+        }
+        case 8: {
+            gco2th(o)->gclist = d->threads;
+            d->threads = o;
+            return;
+        }
+        default:
+            pm_push(d, o);
+    }
+}
+
+static void pm_traversetable(MarkDeque *d, Table *h) {
+    global_State *g = d->pool->g;
+    int i;
+    int weakkey = 0;
+    int weakvalue = 0;
+    if (h->metatable) {
+        Table *mt = h->metatable;
+        pm_markobject(d, obj2gco(mt));
+        // 不能用 gfasttm: 它会改写元表的 flags 缓存, 多个线程会同时写
+        if (!(mt->flags & (1u << TM_MODE))) {
+            const TValue *mode = luaH_getstr(mt, g->tmname[TM_MODE]);
+            if (ttisstring(mode)) {
+                weakkey = (strchr(svalue(mode), 'k') != NULL);
+                weakvalue = (strchr(svalue(mode), 'v') != NULL);
+            }
+        }
+    }
+    if (weakkey || weakvalue) {
+        pm_resetbits(obj2gco(h), bitmask(3) | bitmask(4));
+        pm_setbits(obj2gco(h), (weakkey << 3) | (weakvalue << 4));
+        h->gclist = d->weak;
+        d->weak = obj2gco(h);
+        pm_resetbits(obj2gco(h), bitmask(2));
+        if (weakkey && weakvalue) return;
+    }
+    if (!weakvalue) {
+        i = h->sizearray;
+        while (i--) pm_markvalue(d, &h->array[i]);
+    }
+    i = sizenode(h);
+    while (i--) {
+        Node *n = gnode(h, i);
+        if (ttisnil(gval(n)))
+            removeentry(n);
+        else {
+            if (!weakkey) pm_markvalue(d, gkey(n));
+            if (!weakvalue) pm_markvalue(d, gval(n));
+        }
+    }
+}
+
+static void pm_traverse(MarkDeque *d, GCObject *o) {
+    int i;
+    pm_setbits(o, bitmask(2));
+    switch (o->gch.tt) {
+        case 5: {
+            Table *h = gco2h(o);
+            pm_traversetable(d, h);
+            d->work += sizeof(Table) + sizeof(TValue) * h->sizearray + sizeof(Node) * sizenode(h);
+            break;
+        }
+        case 6: {
+            Closure *cl = gco2cl(o);
+            pm_markobject(d, obj2gco(cl->c.env));
+            if (cl->c.isC) {
+                for (i = 0; i < cl->c.nupvalues; i++) pm_markvalue(d, &cl->c.upvalue[i]);
+                d->work += sizeCclosure(cl->c.nupvalues);
+            } else {
+                pm_markobject(d, obj2gco(cl->l.p));
+                for (i = 0; i < cl->l.nupvalues; i++) pm_markobject(d, obj2gco(cl->l.upvals[i]));
+                d->work += sizeLclosure(cl->l.nupvalues);
+            }
+            break;
+        }
+        case (8 + 1): {
+            Proto *f = gco2p(o);
+            if (f->source) pm_resetbits(obj2gco(f->source), bit2mask(0, 1));
+            for (i = 0; i < f->sizek; i++) pm_markvalue(d, &f->k[i]);
+            for (i = 0; i < f->sizeupvalues; i++) {
+                if (f->upvalues[i])
+                    pm_resetbits(obj2gco(f->upvalues[i]), bit2mask(0, 1));
+            }
+            for (i = 0; i < f->sizep; i++) {
+                if (f->p[i]) pm_markobject(d, obj2gco(f->p[i]));
+            }
+            for (i = 0; i < f->sizelocvars; i++) {
+                if (f->locvars[i].varname)
+                    pm_resetbits(obj2gco(f->locvars[i].varname), bit2mask(0, 1));
+            }
+            d->work += sizeof(Proto) + sizeof(Instruction) * f->sizecode +
+                       sizeof(int) * f->sizecache + sizeof(Proto *) * f->sizep +
+                       sizeof(TValue) * f->sizek + sizeof(int) * f->sizelineinfo +
+                       sizeof(LocVar) * f->sizelocvars + sizeof(TString *) * f->sizeupvalues;
+            break;
+        }
+        default:;
+    }
+}
+
+// 先清空自己的队列, 然后去偷别人的; 所有线程都找不到活时结束
+static void pm_drain(MarkDeque *d) {
+    MarkPool *p = d->pool;
+    GCObject *o;
+    for (;;) {
+        while ((o = pm_take(d)) != NULL)
+            pm_traverse(d, o);
+        __atomic_add_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            int i;
+            o = NULL;
+            for (i = 1; i < p->n && o == NULL; i++)
+                o = pm_steal(&p->dq[(d->id + i) % p->n]);
+            if (o != NULL) {
+                __atomic_sub_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+                pm_traverse(d, o);
+                break;
+            }
+            if (__atomic_load_n(&p->idle, __ATOMIC_SEQ_CST) == p->n)
+                return;
+            sched_yield();
+        }
+    }
+}
+
+static void *pm_worker(void *ud) {
+    MarkDeque *d = (MarkDeque *) ud;
+    MarkPool *p = d->pool;
+    unsigned seen = 0;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->gen == seen && !p->quit)
+            pthread_cond_wait(&p->start, &p->lock);
+        if (p->quit)
+            break;
+        seen = p->gen;
+        pthread_mutex_unlock(&p->lock);
+        pm_drain(d);
+        pthread_mutex_lock(&p->lock);
+        if (++p->finished == p->n - 1)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// 把 g->gray 上的对象分给各个线程并行标记; 遇到的线程对象挂回 g->gray, 由调用者串行遍历
+static size_t pm_propagate(global_State *g) {
+    MarkPool *p = g->markpool;
+    size_t work = 0;
+    int i;
+    for (i = 0; i < p->n; i++) {
+        p->dq[i].weak = NULL;
+        p->dq[i].threads = NULL;
+        p->dq[i].work = 0;
+    }
+    for (i = 0; g->gray != NULL; i++) {
+        GCObject *o = g->gray;
+        g->gray = *gclistof(o);
+        if (o->gch.tt == 8) {
+            gco2th(o)->gclist = p->dq[0].threads;
+            p->dq[0].threads = o;
+        } else
+            pm_push(&p->dq[i % p->n], o);
+    }
+    p->idle = 0;
+    pthread_mutex_lock(&p->lock);
+    p->finished = 0;
+    p->gen++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+    pm_drain(&p->dq[0]);
+    pthread_mutex_lock(&p->lock);
+    while (p->finished < p->n - 1)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < p->n; i++) {
+        MarkDeque *d = &p->dq[i];
+        work += d->work;
+        g->gcstats.marked += d->marked;
+        d->marked = 0;
+        while (d->weak) {
+            GCObject *o = d->weak;
+            d->weak = gco2h(o)->gclist;
+            gco2h(o)->gclist = g->weak;
+            g->weak = o;
+        }
+        while (d->threads) {
+            GCObject *o = d->threads;
+            d->threads = gco2th(o)->gclist;
+            gco2th(o)->gclist = g->gray;
+            g->gray = o;
+        }
+    }
+    return work;
+}
+
+static void pm_stop(lua_State *L) {
+    global_State *g = G(L);
+    MarkPool *p = g->markpool;
+    int i;
+    if (p == NULL)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 1; i < p->n; i++)
+        pthread_join(p->tid[i], NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    luaM_freemem(L, p, sizeof(MarkPool) + (p->size - 1) * sizeof(MarkDeque));
+    g->markpool = NULL;
+}
+
+static void pm_start(lua_State *L, int n) {
+    global_State *g = G(L);
+    MarkPool *p = (MarkPool *) luaM_malloc(L, sizeof(MarkPool) + (n - 1) * sizeof(MarkDeque));
+    int i;
+    memset(p, 0, sizeof(MarkPool) + (n - 1) * sizeof(MarkDeque));
+    p->g = g;
+    p->n = 1;
+    p->size = n;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+    for (i = 0; i < n; i++) {
+        p->dq[i].pool = p;
+        p->dq[i].id = i;
+    }
+    for (i = 1; i < n; i++) {
+        if (pthread_create(&p->tid[i], NULL, pm_worker, &p->dq[i]) != 0)
+            break;
+        p->n++;
+    }
+    g->markpool = p;
+}
+
+#endif
+
 static size_t propagateall(global_State *g) {
     size_t m = 0;
+#ifdef LUA_USE_PARMARK
+    if (g->markpool != NULL && g->totalbytes >= PM_MINHEAP) {
+        while (g->gray) {
+            GCObject *th;
+            m += pm_propagate(g);
+            // 剩下的都是线程: 逐个串行遍历栈, 栈上引到的新对象留在 g->gray 里交给下一轮并行标记
+            th = g->gray;
+            g->gray = NULL;
+            while (th) {
+                GCObject *next = gco2th(th)->gclist;
+                gco2th(th)->gclist = g->gray;
+                g->gray = th;
+                m += propagatemark(g);
+                th = next;
+            }
+        }
+        return m;
+    }
+#endif
     while (g->gray)m += propagatemark(g);
     return m;
 }
@@ -2139,25 +3065,205 @@ static void freeobj(lua_State *L, GCObject *o) {
     }
 }
 
-#define sweepwholelist(L, p)sweeplist(L,p,((lu_mem)(~(lu_mem)0)-2))
+#ifdef LUA_USE_BGSWEEP
 
-static GCObject **sweeplist(lua_State *L, GCObject **p, lu_mem count) {
-    GCObject *curr;
-    global_State *g = G(L);
-    int deadmask = otherwhite(g);
-    while ((curr = *p) != NULL && count-- > 0) {
-        if (curr->gch.tt == 8)
-            sweepwholelist(L, &gco2th(curr)->openupval);
-        if ((curr->gch.marked ^ bit2mask(0, 1)) & deadmask) {
-            makewhite(g, curr);
-            p = &curr->gch.next;
-        } else {
-            *p = curr->gch.next;
-            if (curr == g->rootgc)
-                g->rootgc = curr->gch.next;
-            freeobj(L, curr);
-        }
-    }
+// 后台清扫: 清扫阶段仍由 mutator 遍历链表, 摘下死对象并立刻扣掉 totalbytes,
+// 真正的 free 交给后台线程. 摘下的对象用 next 串成链, 通过无锁栈 pending 交接.
+// 要求分配函数可以在别的线程里调用
+typedef struct Sweeper {
+    global_State *g;
+    GCObject *pending;          // 等待后台释放的对象, mutator 用 CAS 压入整条链, 后台线程一次取走
+    GCObject *head;             // 还没交出去的死对象, 只有 mutator 访问
+    GCObject *tail;
+    int quit;
+    pthread_mutex_t lock;       // 只用来睡眠和唤醒, 交接本身不加锁
+    pthread_cond_t wake;
+    pthread_t tid;
+} Sweeper;
+
+static void bg_free(global_State *g, GCObject *o) {
+    lua_Alloc f = g->frealloc;
+    void *ud = g->userdata;
+    switch (o->gch.tt) {
+        case 4:
+            (*f)(ud, o, sizestring(gco2ts(o)), 0);
+            break;
+        case 7:
+            (*f)(ud, o, sizeudata(gco2u(o)), 0);
+            break;
+        case 6: {
+            Closure *c = gco2cl(o);
+            (*f)(ud, o, c->c.isC ? sizeCclosure(c->c.nupvalues) : sizeLclosure(c->l.nupvalues), 0);
+            break;
+        }
+        case 5: {
+            Table *t = gco2h(o);
+            if (t->node != (&dummynode_))
+                (*f)(ud, t->node, nodevecsize(sizenode(t)), 0);
+            (*f)(ud, t->array, t->sizearray * sizeof(TValue), 0);
+            (*f)(ud, o, sizeof(Table), 0);
+            break;
+        }
+        default:
+            (*f)(ud, o, sizeof(UpVal), 0);
+    }
+}
+
+static void *bg_main(void *ud) {
+    Sweeper *s = (Sweeper *) ud;
+    for (;;) {
+        GCObject *o;
+        pthread_mutex_lock(&s->lock);
+        while (__atomic_load_n(&s->pending, __ATOMIC_ACQUIRE) == NULL && !s->quit)
+            pthread_cond_wait(&s->wake, &s->lock);
+        pthread_mutex_unlock(&s->lock);
+        o = __atomic_exchange_n(&s->pending, NULL, __ATOMIC_ACQUIRE);
+        if (o == NULL)
+            break;
+        while (o != NULL) {
+            GCObject *next = o->gch.next;
+            bg_free(s->g, o);
+            o = next;
+        }
+    }
+    return NULL;
+}
+
+// 摘下一个死对象交给后台线程; 线程, 原型和打开的上值释放时会碰到全局状态, 返回 0 让调用者直接释放
+static int bg_dispose(lua_State *L, GCObject *o) {
+    global_State *g = G(L);
+    Sweeper *s = g->sweeper;
+    size_t size;
+    if (g->arenabase != NULL)   // 对象的各部分可能落在竞技场里, 由 luaM_realloc_ 判断
+        return 0;
+    switch (o->gch.tt) {
+        case 4:
+            g->strt.nUse--;
+            size = sizestring(gco2ts(o));
+            break;
+        case 7:
+            size = sizeudata(gco2u(o));
+            break;
+        case 6: {
+            Closure *c = gco2cl(o);
+            size = c->c.isC ? sizeCclosure(c->c.nupvalues) : sizeLclosure(c->l.nupvalues);
+            break;
+        }
+        case 5: {
+            Table *t = gco2h(o);
+            size = sizeof(Table) + sizeof(TValue) * t->sizearray;
+            if (t->node != (&dummynode_))
+                size += nodevecsize(sizenode(t));
+            break;
+        }
+        case (8 + 2):
+            if (gco2uv(o)->v != &gco2uv(o)->u.value)
+                return 0;
+            size = sizeof(UpVal);
+            break;
+        default:
+            return 0;
+    }
+    g->totalbytes -= size;
+    if (s->head == NULL)
+        s->tail = o;
+    o->gch.next = s->head;
+    s->head = o;
+    return 1;
+}
+
+static void bg_flush(global_State *g) {
+    Sweeper *s = g->sweeper;
+    GCObject *old;
+    if (s == NULL || s->head == NULL)
+        return;
+    old = __atomic_load_n(&s->pending, __ATOMIC_RELAXED);
+    do {
+        s->tail->gch.next = old;
+    } while (!__atomic_compare_exchange_n(&s->pending, &old, s->head, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    s->head = NULL;
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// 交出手上的垃圾, 等后台线程全部释放完后退出
+static void bg_stop(lua_State *L) {
+    global_State *g = G(L);
+    Sweeper *s = g->sweeper;
+    if (s == NULL)
+        return;
+    bg_flush(g);
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->tid, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->wake);
+    g->sweeper = NULL;
+    luaM_free(L, s);
+}
+
+static void bg_start(lua_State *L) {
+    global_State *g = G(L);
+    Sweeper *s = luaM_new(L, Sweeper);
+    s->g = g;
+    s->pending = NULL;
+    s->head = NULL;
+    s->tail = NULL;
+    s->quit = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    if (pthread_create(&s->tid, NULL, bg_main, s) != 0) {
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->wake);
+        luaM_free(L, s);
+        return;
+    }
+    g->sweeper = s;
+}
+
+// 内存分配失败时调用: 停掉线程就会等它把手上的垃圾全部释放完, 然后重新启动
+static void bg_drain(lua_State *L) {
+    bg_stop(L);
+    bg_start(L);
+}
+
+#endif
+
+#define sweepwholelist(L, p)sweeplist(L,p,((lu_mem)(~(lu_mem)0)-2))
+
+static GCObject **sweeplist(lua_State *L, GCObject **p, lu_mem count) {
+    GCObject *curr;
+    global_State *g = G(L);
+    int deadmask = otherwhite(g);
+    int gen = (g->gckind == LUA_GCGEN);
+    while ((curr = *p) != NULL && count-- > 0) {
+        if (gen && isold(curr)) {
+            // 新对象总是插在链表头部, 碰到老对象说明后面都是老对象, 小回收不再往下扫
+            static GCObject *nullp = NULL;
+            return &nullp;
+        }
+        if (curr->gch.tt == 8)
+            sweepwholelist(L, &gco2th(curr)->openupval);
+        if ((curr->gch.marked ^ bit2mask(0, 1)) & deadmask) {
+            if (!gen)
+                makewhite(g, curr);
+            else if (!iswhite(curr))    // 分代模式下活下来的对象保留标记, 变成老对象
+                l_setbit(curr->gch.marked, 7);
+            p = &curr->gch.next;
+        } else {
+            *p = curr->gch.next;
+            if (curr == g->rootgc)
+                g->rootgc = curr->gch.next;
+#ifdef LUA_USE_BGSWEEP
+            if (g->sweeper != NULL && bg_dispose(L, curr))
+                continue;
+#endif
+            freeobj(L, curr);
+        }
+    }
     return p;
 }
 
@@ -2187,6 +3293,7 @@ static void GCTM(lua_State *L) {
     tm = fasttm(L, udata->uv.metatable, TM_GC);
     if (tm != NULL) {
         lu_byte oldah = L->allowhook;
+        g->gcstats.finalized++;
         lu_mem oldt = g->GCthreshold;
         L->allowhook = 0;
         g->GCthreshold = 2 * g->totalbytes;
@@ -2207,6 +3314,7 @@ static void luaC_callGCTM(lua_State *L) {
 static void luaC_freeall(lua_State *L) {
     global_State *g = G(L);
     int i;
+    g->gckind = LUA_GCINC;
     g->currentwhite = bit2mask(0, 1) | bitmask(6);
     sweepwholelist(L, &g->rootgc);
     for (i = 0; i < g->strt.size; i++)
@@ -2219,11 +3327,30 @@ static void markmt(global_State *g) {
         if (g->mt[i]) markobject(g, g->mt[i]);
 }
 
+// 老的线程和弱表在小回收里不会被重新标记到, 把上一轮 atomic 留下的它们重新放回灰色链表
+static void regray(global_State *g, GCObject *l) {
+    while (l) {
+        GCObject *o = l;
+        GCObject **next = (o->gch.tt == 8) ? &gco2th(o)->gclist : &gco2h(o)->gclist;
+        l = *next;
+        if (isgray(o)) {
+            *next = g->gray;
+            g->gray = o;
+        }
+    }
+}
+
 static void markroot(lua_State *L) {
     global_State *g = G(L);
+    GCObject *again = g->grayagain;
+    GCObject *weak = g->weak;
     g->gray = NULL;
     g->grayagain = NULL;
     g->weak = NULL;
+    if (g->gckind == LUA_GCGEN) {
+        regray(g, again);
+        regray(g, weak);
+    }
     markobject(g, g->mainthread);
     markvalue(g, gt(g->mainthread));
     markvalue(g, registry(L));
@@ -2238,9 +3365,40 @@ static void remarkupvals(global_State *g) {
     }
 }
 
+static double gc_clock(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// 计时只在一次回收停顿的两头和阶段切换时读时钟, 逐步清扫字符串时每一步都很短, 不能每步都读
+static double gc_begin(global_State *g) {
+    g->gcphaseclock = gc_clock();
+    return g->gcphaseclock;
+}
+
+// 结束一次停顿: 把最后一段时间记到当前阶段, 停顿时长按微秒数落到 2 的幂次的格子里
+static void gc_end(global_State *g, double t0) {
+    double now = gc_clock();
+    double dt = now - t0;
+    double us = dt * 1e6;
+    int i = 0;
+    g->gcstats.phasetime[g->gcstate] += now - g->gcphaseclock;
+    while (i < LUA_GCHIST - 1 && us >= (double) (1u << i))
+        i++;
+    g->gcstats.pausehist[i]++;
+    if (dt > g->gcstats.pausemax)
+        g->gcstats.pausemax = dt;
+}
+
 static void atomic(lua_State *L) {
     global_State *g = G(L);
     size_t udsize;
+    double t0 = gc_clock();
     remarkupvals(g);
     propagateall(g);
     g->gray = g->weak;
@@ -2260,9 +3418,14 @@ static void atomic(lua_State *L) {
     g->sweepgc = &g->rootgc;
     g->gcstate = GCS_SWEEPSTRING;
     g->estimate = g->totalbytes - udsize;
+    g->gcstats.lastfreed = 0;
+    t0 = gc_clock() - t0;
+    g->gcstats.atomictime += t0;
+    if (t0 > g->gcstats.atomicmax)
+        g->gcstats.atomicmax = t0;
 }
 
-static l_mem singlestep(lua_State *L) {
+static l_mem dostep(lua_State *L) {
     global_State *g = G(L);
     switch (g->gcstate) {
         case GCS_PAUSE: {
@@ -2279,7 +3442,15 @@ static l_mem singlestep(lua_State *L) {
         }
         case GCS_SWEEPSTRING: {
             lu_mem old = g->totalbytes;
-            sweepwholelist(L, &g->strt.hash[g->sweepstrgc++]);
+            if (g->gckind == LUA_GCGEN) {
+                // 小回收一次扫完所有桶; 链首已经是老字符串的桶里没有新字符串, 直接跳过
+                for (; g->sweepstrgc < g->strt.size; g->sweepstrgc++) {
+                    GCObject *o = g->strt.hash[g->sweepstrgc];
+                    if (o != NULL && !isold(o))
+                        sweepwholelist(L, &g->strt.hash[g->sweepstrgc]);
+                }
+            } else
+                sweepwholelist(L, &g->strt.hash[g->sweepstrgc++]);
             if (g->sweepstrgc >= g->strt.size)
                 g->gcstate = GCS_SWEEP;
             g->estimate -= old - g->totalbytes;
@@ -2289,6 +3460,9 @@ static l_mem singlestep(lua_State *L) {
             lu_mem old = g->totalbytes;
             g->sweepgc = sweeplist(L, g->sweepgc, 40);
             if (*g->sweepgc == NULL) {
+                // 分代模式下 rootgc 的清扫停在老对象处, 挂在主线程后面的 userdata 要单独清扫
+                if (g->gckind == LUA_GCGEN)
+                    sweepwholelist(L, &g->mainthread->next);
                 checkSizes(L);
                 g->gcstate = GCS_FINALIZE;
             }
@@ -2312,9 +3486,114 @@ static l_mem singlestep(lua_State *L) {
     }
 }
 
+// 统计清扫释放的字节数, 阶段切换时把这段时间记到上一个阶段; atomic 的时间同时也算在 GCS_PROPAGATE 里
+static l_mem singlestep(lua_State *L) {
+    global_State *g = G(L);
+    int phase = g->gcstate;
+    lu_mem old = g->totalbytes;
+    l_mem work = dostep(L);
+    if (g->gcstate != phase) {
+        double now = gc_clock();
+        g->gcstats.phasetime[phase] += now - g->gcphaseclock;
+        g->gcphaseclock = now;
+    }
+    if ((phase == GCS_SWEEPSTRING || phase == GCS_SWEEP) && g->totalbytes < old) {
+        g->gcstats.freed += old - g->totalbytes;
+        g->gcstats.lastfreed += old - g->totalbytes;
+    }
+    if (phase == GCS_FINALIZE && g->gcstate == GCS_PAUSE)
+        g->gcstats.cycles++;
+    return work;
+}
+
+// 分代模式的小回收: 一次做完一整轮, 老对象保持黑色不再遍历, 清扫只走到第一个老对象.
+// 做完立刻开始下一轮标记, 让两次回收之间写屏障始终向前标记, 终结器也放到这之后调用
+static void luaC_minor(lua_State *L) {
+    global_State *g = G(L);
+    if (g->gcstate == GCS_PROPAGATE)
+        propagateall(g);
+    while (g->gcstate != GCS_FINALIZE)
+        singlestep(L);
+    markroot(L);
+    g->gcstats.minors++;
+    luaC_callGCTM(L);
+}
+
+// 完整回收: 先把所有对象 (包括老对象) 清扫回白色, 再完整地跑一轮; 分代模式下这就是大回收
+static void fullgc(lua_State *L) {
+    global_State *g = G(L);
+    int kind = g->gckind;
+    if (g->gcstate <= GCS_PROPAGATE) {
+        g->sweepstrgc = 0;
+        g->sweepgc = &g->rootgc;
+        g->gray = NULL;
+        g->grayagain = NULL;
+        g->weak = NULL;
+        g->gcstate = GCS_SWEEPSTRING;
+    }
+    g->gckind = LUA_GCINC;
+    while (g->gcstate != GCS_FINALIZE)
+        singlestep(L);
+    g->gckind = cast_byte(kind);
+    g->grayagain = NULL;
+    g->weak = NULL;
+    markroot(L);
+    if (kind == LUA_GCGEN) {
+        luaC_minor(L);
+        g->lastmajor = g->totalbytes;
+        g->gcstats.cycles++;
+    } else {
+        propagateall(g);
+        while (g->gcstate != GCS_PAUSE)
+            singlestep(L);
+    }
+    setthreshold(g);
+#ifdef LUA_USE_BGSWEEP
+    bg_flush(g);
+#endif
+}
+
+// 到达内存上限: 做一次完整回收, 顺带清理弱表, 收缩字符串表, 缓冲区和各个栈; 仍然超限就报内存错误
+static void emergencygc(lua_State *L) {
+    global_State *g = G(L);
+    g->gcstats.emergencies++;
+    fullgc(L);
+    if (g->totalbytes >= g->memlimit)
+        luaD_throw(L, 4);
+}
+
+static void luaC_fullgc(lua_State *L) {
+    global_State *g = G(L);
+    double t0 = gc_begin(g);
+    fullgc(L);
+    gc_end(g, t0);
+}
+
 static void luaC_step(lua_State *L) {
     global_State *g = G(L);
     l_mem lim = (1024u / 100) * g->gcstepmul;
+    double t0 = gc_begin(g);
+    if (g->memlimit != 0 && g->totalbytes >= g->memlimit) {
+        emergencygc(L);
+        gc_end(g, t0);
+        return;
+    }
+    if (g->gckind == LUA_GCGEN) {
+        if (g->lastmajor == 0)
+            fullgc(L);
+        else {
+            luaC_minor(L);
+            // 小回收后存活的内存比上次大回收后增长太多, 说明老对象里积累了垃圾, 下次做大回收
+            if (g->totalbytes > (g->lastmajor / 100) * g->gcmajorinc)
+                g->lastmajor = 0;
+            setthreshold(g);
+#ifdef LUA_USE_BGSWEEP
+            bg_flush(g);
+#endif
+        }
+        gc_end(g, t0);
+        return;
+    }
     if (lim == 0)
         lim = (((lu_mem) (~(lu_mem) 0) - 2) - 1) / 2;
     g->gcdept += g->totalbytes - g->GCthreshold;
@@ -2333,6 +3612,10 @@ static void luaC_step(lua_State *L) {
     } else {
         setthreshold(g);
     }
+#ifdef LUA_USE_BGSWEEP
+    bg_flush(g);
+#endif
+    gc_end(g, t0);
 }
 
 static void luaC_barrierf(lua_State *L, GCObject *o, GCObject *v) {
@@ -2364,6 +3647,7 @@ static void luaC_linkupval(lua_State *L, UpVal *uv) {
     GCObject *o = obj2gco(uv);
     o->gch.next = g->rootgc;
     g->rootgc = o;
+    resetbit(o->gch.marked, 7);     // 挂到了链表头部, 不再算老对象
     if (isgray(o)) {
         if (g->gcstate == GCS_PROPAGATE) {
             gray2black(o);
@@ -2460,16 +3744,31 @@ static void preInitState(lua_State *L, global_State *g) {
     L->base_ci = L->ci = NULL;
     L->savedpc = NULL;
     L->errfunc = 0;
+    L->nextpos = 0;
     setnilvalue(gt(L));
 }
 
 static void close_state(lua_State *L) {
     global_State *g = G(L);
+#ifdef LUA_USE_PARMARK
+    pm_stop(L);
+#endif
+#ifdef LUA_USE_BGSWEEP
+    bg_stop(L);
+#endif
     luaF_close(L, L->stack);
     luaC_freeall(L);
     luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size, TString*);
     luaZ_freebuffer(L, &g->buff);
+    while (g->images != NULL) {
+        Image *im = g->images;
+        g->images = im->next;
+        (*im->release)(im->p, im->size);
+        luaM_free(L, im);
+    }
     freestack(L, L);
+    if (g->arenabase != NULL)
+        (*g->frealloc)(g->userdata, g->arenabase, g->arenaend - g->arenabase, 0);
     (*g->frealloc)(g->userdata, fromstate(L), sizeof(LG), 0);
 }
 
@@ -2518,9 +3817,21 @@ lua_State *lua_newState(lua_Alloc f, void *userdata) {
     g->grayagain = NULL;
     g->weak = NULL;
     g->tmudata = NULL;
+    g->images = NULL;
+    g->markpool = NULL;
+    g->sweeper = NULL;
+    g->arenabase = NULL;
+    g->arenatop = NULL;
+    g->arenaend = NULL;
+    memset(&g->gcstats, 0, sizeof(g->gcstats));
     g->totalbytes = sizeof(LG);
+    g->gckind = LUA_GCINC;
     g->gcpause = 200;
     g->gcstepmul = 200;
+    g->gcmajorinc = 200;
+    g->lastmajor = 0;
+    g->memlimit = 0;
+    g->gcstopped = 0;
     g->gcdept = 0;
     for (i = 0; i < (8 + 1); i++)g->mt[i] = NULL;
     if (luaD_rawrunprotected(L, f_luaopen, NULL) != 0) {
@@ -2771,6 +4082,188 @@ static void luaG_runerror(lua_State *L, const char *fmt, ...) {
     luaG_errormsg(L);
 }
 
+// 预编译代码的校验, 移植自 5.1 的 luaG_checkcode/symbexec (只保留完整检查, 不做寄存器追踪):
+// 寄存器、常量、上值、子函数下标和跳转目标都必须在界内, 否则 VM 会越界读写
+#define check(x)if(!(x))return 0;
+#define checkreg(pt, reg)check((reg)<(pt)->maxstacksize)
+
+static int precheck(const Proto *pt) {
+    check(pt->maxstacksize <= 250);
+    check(pt->numparams + (pt->is_vararg & 1) <= pt->maxstacksize);
+    check(!(pt->is_vararg & 4) || (pt->is_vararg & 1));
+    check(pt->sizeupvalues <= pt->nups);
+    check(pt->sizelineinfo == pt->sizecode || pt->sizelineinfo == 0);
+    check(pt->sizecode > 0 && GET_OPCODE(pt->code[pt->sizecode - 1]) == OP_RETURN);
+    return 1;
+}
+
+// 结果个数不定的调用或 VARARG 之后, 只能紧跟消费栈顶的指令
+static int checkopenop(const Proto *pt, int pc) {
+    Instruction i = pt->code[pc + 1];
+    switch (GET_OPCODE(i)) {
+        case OP_CALL:
+        case OP_TAILCALL:
+        case OP_RETURN:
+        case OP_SETLIST:
+            check(GETARG_B(i) == 0);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int checkArgMode(const Proto *pt, int r, enum OpArgMask mode) {
+    switch (mode) {
+        case OpArgN:
+            check(r == 0);
+            break;
+        case OpArgU:
+            break;
+        case OpArgR:
+            checkreg(pt, r);
+            break;
+        case OpArgK:
+            check(ISK(r) ? INDEXK(r) < pt->sizek : r < pt->maxstacksize);
+            break;
+    }
+    return 1;
+}
+
+static int luaG_checkcode(const Proto *pt) {
+    int pc;
+    check(precheck(pt));
+    for (pc = 0; pc < pt->sizecode; pc++) {
+        Instruction i = pt->code[pc];
+        OpCode op = GET_OPCODE(i);
+        int a = GETARG_A(i);
+        int b = 0;
+        int c = 0;
+        // 运行时特化出的指令不会出现在转储里
+        check(op < OP_ADDNN);
+        checkreg(pt, a);
+        switch (cast(enum OpMode, luaP_opmodes[op] & 3)) {
+            case iABC:
+                b = GETARG_B(i);
+                c = GETARG_C(i);
+                check(checkArgMode(pt, b, getBMode(op)));
+                check(checkArgMode(pt, c, getCMode(op)));
+                break;
+            case iABx:
+                b = GETARG_Bx(i);
+                if (getBMode(op) == OpArgK) check(b < pt->sizek);
+                break;
+            case iAsBx:
+                b = GETARG_sBx(i);
+                if (getBMode(op) == OpArgR) {
+                    int dest = pc + 1 + b;
+                    check(0 <= dest && dest < pt->sizecode);
+                    if (dest > 0) {
+                        int j;
+                        // 不能跳到 SETLIST 的计数字上; 连续几条都像计数字时要数到头才能判断
+                        for (j = 0; j < dest; j++) {
+                            Instruction d = pt->code[dest - 1 - j];
+                            if (!(GET_OPCODE(d) == OP_SETLIST && GETARG_C(d) == 0)) break;
+                        }
+                        check((j & 1) == 0);
+                    }
+                }
+                break;
+        }
+        if (testTMode(op)) {
+            check(pc + 2 < pt->sizecode);
+            check(GET_OPCODE(pt->code[pc + 1]) == OP_JMP);
+        }
+        switch (op) {
+            case OP_LOADBOOL:
+                if (c == 1) {
+                    check(pc + 2 < pt->sizecode);
+                    check(GET_OPCODE(pt->code[pc + 1]) != OP_SETLIST || GETARG_C(pt->code[pc + 1]) != 0);
+                }
+                break;
+            case OP_GETUPVAL:
+            case OP_SETUPVAL:
+                check(b < pt->nups);
+                break;
+            case OP_GETGLOBAL:
+            case OP_SETGLOBAL:
+                check(ttisstring(&pt->k[b]));
+                break;
+            case OP_GETFIELD:
+                // VM 直接按字符串常量取键
+                check(ISK(c) && ttisstring(&pt->k[INDEXK(c)]));
+                break;
+            case OP_SELF:
+                checkreg(pt, a + 1);
+                break;
+            case OP_CONCAT:
+                check(b < c);
+                break;
+            case OP_NEWTABLE:
+                // luaO_fb2int 的指数再大就会溢出 int
+                check(((b >> 3) & 31) <= 28 && ((c >> 3) & 31) <= 28);
+                break;
+            case OP_TFORLOOP:
+                check(c >= 1);
+                checkreg(pt, a + 2 + c);
+                break;
+            case OP_FORPREP: {
+                // 整数模式下 a..a+2 存的是内部表示, 只有配对的 FORLOOP 会读它们
+                Instruction l = pt->code[pc + 1 + b];
+                check(GET_OPCODE(l) == OP_FORLOOP && GETARG_A(l) == a && GETARG_sBx(l) == -b - 1);
+            }
+/*fallthrough*/
+            case OP_FORLOOP:
+                checkreg(pt, a + 3);
+                break;
+            case OP_CALL:
+            case OP_TAILCALL:
+                if (b != 0) {
+                    checkreg(pt, a + b - 1);
+                }
+                c--;
+                if (c == (-1)) {
+                    check(checkopenop(pt, pc));
+                } else if (c != 0)
+                    checkreg(pt, a + c - 1);
+                break;
+            case OP_RETURN:
+                b--;
+                if (b > 0) checkreg(pt, a + b - 1);
+                break;
+            case OP_SETLIST:
+                if (b > 0) checkreg(pt, a + b);
+                if (c == 0) {
+                    pc++;
+                    check(pc < pt->sizecode - 1);
+                }
+                break;
+            case OP_CLOSURE: {
+                int nup, j;
+                check(b < pt->sizep);
+                nup = pt->p[b]->nups;
+                check(pc + nup < pt->sizecode);
+                for (j = 1; j <= nup; j++) {
+                    OpCode op1 = GET_OPCODE(pt->code[pc + j]);
+                    check(op1 == OP_GETUPVAL || op1 == OP_MOVE);
+                }
+                break;
+            }
+            case OP_VARARG:
+                check((pt->is_vararg & 2) && !(pt->is_vararg & 4));
+                b--;
+                if (b == (-1)) check(checkopenop(pt, pc));
+                checkreg(pt, a + b - 1);
+                break;
+            default:
+                break;
+        }
+    }
+    return 1;
+}
+
+#undef check
+#undef checkreg
+
 static int luaZ_fill(ZIO *z) {
     size_t size;
     lua_State *L = z->L;
@@ -2788,6 +4281,7 @@ static void luaZ_init(lua_State *L, ZIO *z, lua_Reader reader, void *data) {
     z->data = data;
     z->n = 0;
     z->p = NULL;
+    z->mapped = 0;
 }
 
 static char *luaZ_openspace(lua_State *L, MBuffer *buff, size_t n) {
@@ -2798,80 +4292,1082 @@ static char *luaZ_openspace(lua_State *L, MBuffer *buff, size_t n) {
     return buff->buffer;
 }
 
-#define opmode(t, a, b, c, m)(((t)<<7)|((a)<<6)|((b)<<4)|((c)<<2)|(m))
-static const lu_byte luaP_opmodes[(cast(int, OP_VARARG) + 1)] = {
-        opmode(0, 1, OpArgR, OpArgN, iABC), opmode(0, 1, OpArgK, OpArgN, iABx), opmode(0, 1, OpArgU, OpArgU, iABC),
-        opmode(0, 1, OpArgR, OpArgN, iABC), opmode(0, 1, OpArgU, OpArgN, iABC), opmode(0, 1, OpArgK, OpArgN, iABx),
-        opmode(0, 1, OpArgR, OpArgK, iABC), opmode(0, 0, OpArgK, OpArgN, iABx), opmode(0, 0, OpArgU, OpArgN, iABC),
-        opmode(0, 0, OpArgK, OpArgK, iABC), opmode(0, 1, OpArgU, OpArgU, iABC), opmode(0, 1, OpArgR, OpArgK, iABC),
-        opmode(0, 1, OpArgK, OpArgK, iABC), opmode(0, 1, OpArgK, OpArgK, iABC), opmode(0, 1, OpArgK, OpArgK, iABC),
-        opmode(0, 1, OpArgK, OpArgK, iABC), opmode(0, 1, OpArgK, OpArgK, iABC), opmode(0, 1, OpArgK, OpArgK, iABC),
-        opmode(0, 1, OpArgR, OpArgN, iABC), opmode(0, 1, OpArgR, OpArgN, iABC), opmode(0, 1, OpArgR, OpArgN, iABC),
-        opmode(0, 1, OpArgR, OpArgR, iABC), opmode(0, 0, OpArgR, OpArgN, iAsBx), opmode(1, 0, OpArgK, OpArgK, iABC),
-        opmode(1, 0, OpArgK, OpArgK, iABC), opmode(1, 0, OpArgK, OpArgK, iABC), opmode(1, 1, OpArgR, OpArgU, iABC),
-        opmode(1, 1, OpArgR, OpArgU, iABC), opmode(0, 1, OpArgU, OpArgU, iABC), opmode(0, 1, OpArgU, OpArgU, iABC),
-        opmode(0, 0, OpArgU, OpArgN, iABC), opmode(0, 1, OpArgR, OpArgN, iAsBx), opmode(0, 1, OpArgR, OpArgN, iAsBx),
-        opmode(1, 0, OpArgN, OpArgU, iABC), opmode(0, 0, OpArgU, OpArgU, iABC), opmode(0, 0, OpArgN, OpArgN, iABC),
-        opmode(0, 1, OpArgU, OpArgN, iABx), opmode(0, 1, OpArgU, OpArgN, iABC)
-};
-#define next(ls)(ls->current=zgetc(ls->z))
-#define currIsNewline(ls)(ls->current=='\n'||ls->current=='\r')
-static const char *const luaX_tokens[] = {
-        "and", "break", "do", "else", "elseif",
-        "end", "false", "for", "function", "if",
-        "in", "local", "nil", "not", "or", "repeat",
-        "return", "then", "true", "until", "while",
-        "..", "...", "==", ">=", "<=", "~=",
-        "<number>", "<name>", "<string>", "<eof>",
-        NULL
-};
-#define save_and_next(ls)(save(ls,ls->current),next(ls))
-
-static void save(LexState *ls, int c) {
-    MBuffer *b = ls->buff;
-    if (b->n + 1 > b->buffsize) {
-        size_t newsize;
-        if (b->buffsize >= ((size_t) (~(size_t) 0) - 2) / 2)
-            luaX_lexerror(ls, "lexical element too long", 0);
-        newsize = b->buffsize * 2;
-        luaZ_resizebuffer(ls->L, b, newsize);
+static int luaZ_lookahead(ZIO *z) {
+    if (z->n == 0) {
+        if (luaZ_fill(z) == (-1))
+            return (-1);
+        else {
+            z->n++;
+            z->p--;
+        }
     }
-    b->buffer[b->n++] = cast(char, c);
+    return char2int(*z->p);
 }
 
-static void luaX_init(lua_State *L) {
-    int i;
-    for (i = 0; i < (cast(int, TK_WHILE - 257 + 1)); i++) {
-        TString *ts = luaS_new(L, luaX_tokens[i]);
-        luaS_fix(ts);
-        ts->tsv.reserved = cast_byte(i + 1);
+static size_t luaZ_read(ZIO *z, void *b, size_t n) {
+    while (n) {
+        size_t m;
+        if (luaZ_lookahead(z) == (-1))
+            return n;
+        m = (n <= z->n) ? n : z->n;
+        memcpy(b, z->p, m);
+        z->n -= m;
+        z->p += m;
+        b = (char *) b + m;
+        n -= m;
     }
+    return 0;
 }
 
-static const char *luaX_token2str(LexState *ls, int token) {
-    if (token < 257) {
-        return (iscntrl(token)) ? luaO_pushfstring(ls->L, "char(%d)", token) :
-               luaO_pushfstring(ls->L, "%c", token);
-    } else
-        return luaX_tokens[token - 257];
+// 预编译字节码格式: 12 字节文件头 + 主函数. 整数都用 7 位一组的变长编码, 指令和数字按本机格式原样写出,
+// 文件头里记录了这些本机格式以及操作码个数, 不一致时拒绝加载.
+// 映像格式与之相同, 只是 code 和 lineinfo 按文件偏移对齐并原样存放, 从 mmap 加载时可以直接引用
+#define LUAC_VERSION 0x51
+#define LUAC_FORMAT 1       // 格式修订号, 改动序列化布局或操作码时递增
+#define LUAC_IMAGE 2        // 映像格式, 与 LUAC_FORMAT 同步修订
+#define LUAC_HEADERSIZE 12
+
+typedef struct DumpState {
+    lua_State *L;
+    lua_Writer writer;
+    void *data;
+    int status;
+    int image;
+    size_t pos;     // 已写出的字节数, 用于映像格式的对齐
+} DumpState;
+
+typedef struct LoadState {
+    lua_State *L;
+    ZIO *Z;
+    MBuffer *b;
+    const char *name;
+    int image;
+    int mapped;     // 映像来自常驻内存, code 与 lineinfo 直接指向它
+    size_t pos;
+} LoadState;
+
+static void luaU_header(char *h, int format) {
+    int x = 1;
+    memcpy(h, LUA_SIGNATURE, sizeof(LUA_SIGNATURE) - 1);
+    h += sizeof(LUA_SIGNATURE) - 1;
+    *h++ = cast(char, LUAC_VERSION);
+    *h++ = cast(char, format);
+    *h++ = cast(char, *(char *) &x);
+    *h++ = cast(char, sizeof(int));
+    *h++ = cast(char, sizeof(size_t));
+    *h++ = cast(char, sizeof(Instruction));
+    *h++ = cast(char, sizeof(lua_Number));
+    *h++ = cast(char, NUM_OPCODES);
 }
 
-static const char *txtToken(LexState *ls, int token) {
-    switch (token) {
-        case TK_NAME:
-        case TK_STRING:
-        case TK_NUMBER:
-            save(ls, '\0');
-            return luaZ_buffer(ls->buff);
-        default:
-            return luaX_token2str(ls, token);
-    }
+static void DumpBlock(const void *b, size_t size, DumpState *D) {
+    if (D->status == 0)
+        D->status = (*D->writer)(D->L, b, size, D->data);
+    D->pos += size;
 }
 
-static void luaX_lexerror(LexState *ls, const char *msg, int token) {
-    char buff[80];
-    luaO_chunkid(buff, getstr(ls->source), 80);
-    msg = luaO_pushfstring(ls->L, "%s:%d: %s", buff, ls->linenumber, msg);
+static void DumpAlign(size_t align, DumpState *D) {
+    static const char pad[8] = {0};
+    if (D->pos % align != 0) DumpBlock(pad, align - D->pos % align, D);
+}
+
+static void DumpByte(int y, DumpState *D) {
+    char x = cast(char, y);
+    DumpBlock(&x, 1, D);
+}
+
+static void DumpSize(size_t x, DumpState *D) {
+    char buff[16];
+    int n = 0;
+    do {
+        buff[n++] = cast(char, (x & 0x7F) | (x > 0x7F ? 0x80 : 0));
+        x >>= 7;
+    } while (x != 0);
+    DumpBlock(buff, n, D);
+}
+
+#define DumpInt(x, D)DumpSize(cast(size_t,x),D)
+
+static void DumpNumber(lua_Number x, DumpState *D) {
+    DumpBlock(&x, sizeof(x), D);
+}
+
+static void DumpString(const TString *s, DumpState *D) {
+    if (s == NULL) {
+        DumpSize(0, D);
+    } else {
+        DumpSize(s->tsv.len + 1, D);
+        DumpBlock(getstr(s), s->tsv.len, D);
+    }
+}
+
+static void DumpFunction(const Proto *f, const TString *p, DumpState *D) {
+    int i;
+    DumpString((f->source == p) ? NULL : f->source, D);
+    DumpInt(f->linedefined, D);
+    DumpInt(f->lastlinedefined, D);
+    DumpByte(f->nups, D);
+    DumpByte(f->numparams, D);
+    DumpByte(f->is_vararg, D);
+    DumpByte(f->maxstacksize, D);
+    DumpInt(f->sizecode, D);
+    if (D->image) DumpAlign(sizeof(Instruction), D);
+    for (i = 0; i < f->sizecode; i++) {     // 特化过的算术指令写回通用形式
+        Instruction ins = f->code[i];
+        SET_OPCODE(ins, genericop(GET_OPCODE(ins)));
+        DumpBlock(&ins, sizeof(ins), D);
+    }
+    DumpInt(f->sizek, D);
+    for (i = 0; i < f->sizek; i++) {
+        const TValue *o = &f->k[i];
+        DumpByte(ttype(o), D);
+        switch (ttype(o)) {
+            case LUA_TBOOLEAN:
+                DumpByte(bvalue(o), D);
+                break;
+            case LUA_TNUMBER:
+                DumpNumber(nvalue(o), D);
+                break;
+            case LUA_TSTRING:
+                DumpString(rawtsvalue(o), D);
+                break;
+            default:
+                break;
+        }
+    }
+    DumpInt(f->sizep, D);
+    for (i = 0; i < f->sizep; i++) DumpFunction(f->p[i], f->source, D);
+    DumpInt(f->sizelineinfo, D);
+    if (D->image) {
+        DumpAlign(sizeof(int), D);
+        DumpBlock(f->lineinfo, sizeof(int) * f->sizelineinfo, D);
+    } else {
+        for (i = 0; i < f->sizelineinfo; i++) DumpInt(f->lineinfo[i], D);
+    }
+    DumpInt(f->sizelocvars, D);
+    for (i = 0; i < f->sizelocvars; i++) {
+        DumpString(f->locvars[i].varname, D);
+        DumpInt(f->locvars[i].startPc, D);
+        DumpInt(f->locvars[i].endPc, D);
+    }
+    DumpInt(f->sizeupvalues, D);
+    for (i = 0; i < f->sizeupvalues; i++) DumpString(f->upvalues[i], D);
+}
+
+static int luaU_dump(lua_State *L, const Proto *f, lua_Writer w, void *data, int image) {
+    DumpState D;
+    char h[LUAC_HEADERSIZE];
+    D.L = L;
+    D.writer = w;
+    D.data = data;
+    D.status = 0;
+    D.image = image;
+    D.pos = 0;
+    luaU_header(h, image ? LUAC_IMAGE : LUAC_FORMAT);
+    DumpBlock(h, LUAC_HEADERSIZE, &D);
+    DumpFunction(f, NULL, &D);
+    return D.status;
+}
+
+static void LoadError(LoadState *S, const char *why) {
+    luaO_pushfstring(S->L, "%s: %s in precompiled chunk", S->name, why);
+    luaD_throw(S->L, LUA_ERRSYNTAX);
+}
+
+static void LoadBlock(LoadState *S, void *b, size_t size) {
+    if (luaZ_read(S->Z, b, size) != 0) LoadError(S, "unexpected end");
+    S->pos += size;
+}
+
+static int LoadByte(LoadState *S) {
+    int c = zgetc(S->Z);
+    if (c == (-1)) LoadError(S, "unexpected end");
+    S->pos++;
+    return c;
+}
+
+// 读取映像中对齐存放的数组: 常驻映像直接返回其中的地址, 否则拷贝到新分配的 b 中
+static void *LoadArray(LoadState *S, void *b, size_t size, size_t align) {
+    while (S->pos % align != 0) LoadByte(S);
+    if (!S->mapped) {
+        LoadBlock(S, b, size);
+        return b;
+    }
+    if (size == 0) return NULL;
+    if (luaZ_lookahead(S->Z) == (-1) || S->Z->n < size) LoadError(S, "unexpected end");
+    b = cast(void *, S->Z->p);
+    S->Z->p += size;
+    S->Z->n -= size;
+    S->pos += size;
+    return b;
+}
+
+static size_t LoadSize(LoadState *S) {
+    size_t x = 0;
+    int shift = 0, c;
+    do {
+        c = LoadByte(S);
+        if (shift >= cast_int(sizeof(size_t)) * 8) LoadError(S, "bad integer");
+        x |= cast(size_t, c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return x;
+}
+
+static int LoadInt(LoadState *S) {
+    size_t x = LoadSize(S);
+    if (x > INT_MAX) LoadError(S, "bad integer");
+    return cast_int(x);
+}
+
+static lua_Number LoadNumber(LoadState *S) {
+    lua_Number x;
+    LoadBlock(S, &x, sizeof(x));
+    return x;
+}
+
+static TString *LoadString(LoadState *S) {
+    size_t size = LoadSize(S);
+    if (size == 0)
+        return NULL;
+    else {
+        char *s = luaZ_openspace(S->L, S->b, size - 1);
+        LoadBlock(S, s, size - 1);
+        return luaS_newlstr(S->L, s, size - 1);
+    }
+}
+
+static Proto *LoadFunction(LoadState *S, TString *p) {
+    lua_State *L = S->L;
+    Proto *f;
+    int i, n;
+    if (++L->nCcalls > LUAI_MAXCCALLS) LoadError(S, "code too deep");
+    f = luaF_newproto(L);
+    f->mapped = cast_byte(S->mapped);
+    setptvalue(L, L->top, f);
+    incr_top(L);
+    f->source = LoadString(S);
+    if (f->source == NULL) f->source = p;
+    f->linedefined = LoadInt(S);
+    f->lastlinedefined = LoadInt(S);
+    f->nups = cast_byte(LoadByte(S));
+    f->numparams = cast_byte(LoadByte(S));
+    f->is_vararg = cast_byte(LoadByte(S));
+    f->maxstacksize = cast_byte(LoadByte(S));
+    n = LoadInt(S);
+    if (S->image) {
+        Instruction *code = S->mapped ? NULL : luaM_newvector(L, n, Instruction);
+        f->code = code;
+        f->sizecode = n;
+        f->code = cast(Instruction *, LoadArray(S, code, n * sizeof(Instruction), sizeof(Instruction)));
+    } else {
+        f->code = luaM_newvector(L, n, Instruction);
+        f->sizecode = n;
+        LoadBlock(S, f->code, n * sizeof(Instruction));
+    }
+    n = LoadInt(S);
+    f->k = luaM_newvector(L, n, TValue);
+    f->sizek = n;
+    for (i = 0; i < n; i++) setnilvalue(&f->k[i]);
+    for (i = 0; i < n; i++) {
+        TValue *o = &f->k[i];
+        switch (LoadByte(S)) {
+            case LUA_TNIL:
+                break;
+            case LUA_TBOOLEAN:
+                setbvalue(o, LoadByte(S) != 0);
+                break;
+            case LUA_TNUMBER:
+                setnvalue(o, LoadNumber(S));
+                break;
+            case LUA_TSTRING: {
+                TString *ts = LoadString(S);
+                if (ts == NULL) LoadError(S, "bad constant");
+                setsvalue(L, o, ts);
+                break;
+            }
+            default:
+                LoadError(S, "bad constant");
+                break;
+        }
+    }
+    n = LoadInt(S);
+    f->p = luaM_newvector(L, n, Proto*);
+    f->sizep = n;
+    for (i = 0; i < n; i++) f->p[i] = NULL;
+    for (i = 0; i < n; i++) f->p[i] = LoadFunction(S, f->source);
+    n = LoadInt(S);
+    if (S->image) {
+        int *lineinfo = S->mapped ? NULL : luaM_newvector(L, n, int);
+        f->lineinfo = lineinfo;
+        f->sizelineinfo = n;
+        f->lineinfo = cast(int *, LoadArray(S, lineinfo, n * sizeof(int), sizeof(int)));
+    } else {
+        f->lineinfo = luaM_newvector(L, n, int);
+        f->sizelineinfo = n;
+        for (i = 0; i < n; i++) f->lineinfo[i] = LoadInt(S);
+    }
+    n = LoadInt(S);
+    f->locvars = luaM_newvector(L, n, LocVar);
+    f->sizelocvars = n;
+    for (i = 0; i < n; i++) f->locvars[i].varname = NULL;
+    for (i = 0; i < n; i++) {
+        f->locvars[i].varname = LoadString(S);
+        f->locvars[i].startPc = LoadInt(S);
+        f->locvars[i].endPc = LoadInt(S);
+    }
+    n = LoadInt(S);
+    f->upvalues = luaM_newvector(L, n, TString*);
+    f->sizeupvalues = n;
+    for (i = 0; i < n; i++) f->upvalues[i] = NULL;
+    for (i = 0; i < n; i++) f->upvalues[i] = LoadString(S);
+    if (f->sizeupvalues != 0 && f->sizeupvalues != f->nups) LoadError(S, "bad upvalues");
+    if (!luaG_checkcode(f)) LoadError(S, "bad code");
+    luaF_initcache(L, f);
+    L->top--;
+    L->nCcalls--;
+    return f;
+}
+
+static Proto *luaU_undump(lua_State *L, ZIO *Z, MBuffer *buff, const char *name) {
+    LoadState S;
+    char h[LUAC_HEADERSIZE];
+    char s[LUAC_HEADERSIZE];
+    if (*name == '@' || *name == '=')
+        S.name = name + 1;
+    else if (*name == LUA_SIGNATURE[0])
+        S.name = "binary string";
+    else
+        S.name = name;
+    S.L = L;
+    S.Z = Z;
+    S.b = buff;
+    S.pos = 0;
+    S.image = 0;
+    S.mapped = 0;
+    luaU_header(h, LUAC_FORMAT);
+    LoadBlock(&S, s, LUAC_HEADERSIZE);
+    if (memcmp(h, s, sizeof(LUA_SIGNATURE) - 1) != 0) LoadError(&S, "bad header");
+    if (s[4] != h[4] || (s[5] != LUAC_FORMAT && s[5] != LUAC_IMAGE)) LoadError(&S, "version mismatch");
+    h[5] = s[5];
+    if (memcmp(h, s, LUAC_HEADERSIZE) != 0) LoadError(&S, "incompatible format");
+    S.image = (s[5] == LUAC_IMAGE);
+    S.mapped = S.image && Z->mapped;
+    return LoadFunction(&S, luaS_newlstr(L, "=?", 2));
+}
+
+// 整个状态机的快照: 从注册表, 全局表和基本类型元表出发, 把可达的表, Lua 闭包, 上值和函数原型都写出来.
+// C 函数和 userdata 无法序列化, 它们按从注册表出发的字符串键路径 (如 _LOADED.string.format) 命名,
+// 恢复时在已经打开了同样库的状态机里按路径找回. 能按路径找到的表同样复用已有对象, 只替换内容.
+// 格式: 文件头, 对象个数, 每个对象的外壳 (创建它所需的信息), 每个对象的内容, 最后是各个根
+#define LUAC_SNAPSHOT 3     // 快照格式, 与 LUAC_FORMAT 同步修订
+#define SNAP_DEPTH 3        // 命名路径的最大深度
+#define SNAP_PATHS 4        // 每个命名对象最多记录的路径数, 恢复时取第一个能找到的
+
+enum SnapKind {
+    SN_NAMED, SN_TABLE, SN_CLOSURE, SN_UPVAL, SN_PROTO
+};
+
+enum SnapValue {
+    SV_NIL, SV_FALSE, SV_TRUE, SV_NUMBER, SV_INT, SV_STRING, SV_STRREF, SV_REF
+};
+
+typedef struct SnapObj {
+    GCObject *o;
+    int name;           // 在 names 中的下标, -1 表示匿名对象
+    Table *h;           // 恢复时: 命名表的新内容先放在这里, 全部读完才换进去
+} SnapObj;
+
+typedef struct SnapName {
+    int npath;
+    int nseg[SNAP_PATHS];
+    TString *seg[SNAP_PATHS][SNAP_DEPTH];
+} SnapName;
+
+// 指针 -> 对象编号的开放寻址哈希表
+typedef struct SnapMap {
+    const void **key;
+    int *val;
+    int size;
+    int n;
+} SnapMap;
+
+typedef struct SnapState {
+    SnapMap map;
+    SnapMap strs;       // 写出时: 字符串 -> 首次出现的序号, 重复的字符串只写序号
+    TString **str;      // 读入时: 序号 -> 字符串
+    int sizestr;
+    int nstr;
+    SnapObj *obj;
+    int sizeobj;
+    int nobj;
+    SnapName *names;
+    int sizenames;
+    int nnames;
+    TString **keys;     // 命名时排序用的临时数组
+    int sizekeys;
+    union {
+        DumpState D;
+        LoadState S;
+    } u;
+} SnapState;
+
+#define snaphash(p, size)(cast(int,(cast(size_t,p)>>3)*2654435761u)&((size)-1))
+
+static int snap_find(SnapMap *m, const void *p) {
+    int i;
+    if (m->size == 0) return -1;
+    for (i = snaphash(p, m->size); m->key[i] != NULL; i = (i + 1) & (m->size - 1))
+        if (m->key[i] == p) return m->val[i];
+    return -1;
+}
+
+static void snap_insert(lua_State *L, SnapMap *m, const void *p, int v) {
+    int i;
+    if (2 * (m->n + 1) > m->size) {
+        SnapMap nm;
+        nm.size = m->size ? 2 * m->size : 64;
+        nm.n = 0;
+        nm.key = luaM_newvector(L, nm.size, const void*);
+        nm.val = luaM_newvector(L, nm.size, int);
+        for (i = 0; i < nm.size; i++) nm.key[i] = NULL;
+        for (i = 0; i < m->size; i++)
+            if (m->key[i] != NULL) snap_insert(L, &nm, m->key[i], m->val[i]);
+        luaM_freearray(L, m->key, m->size, const void*);
+        luaM_freearray(L, m->val, m->size, int);
+        *m = nm;
+    }
+    for (i = snaphash(p, m->size); m->key[i] != NULL; i = (i + 1) & (m->size - 1));
+    m->key[i] = p;
+    m->val[i] = v;
+    m->n++;
+}
+
+static void snap_free(lua_State *L, SnapState *ss) {
+    luaM_freearray(L, ss->map.key, ss->map.size, const void*);
+    luaM_freearray(L, ss->map.val, ss->map.size, int);
+    luaM_freearray(L, ss->strs.key, ss->strs.size, const void*);
+    luaM_freearray(L, ss->strs.val, ss->strs.size, int);
+    luaM_freearray(L, ss->str, ss->sizestr, TString*);
+    luaM_freearray(L, ss->obj, ss->sizeobj, SnapObj);
+    luaM_freearray(L, ss->names, ss->sizenames, SnapName);
+    luaM_freearray(L, ss->keys, ss->sizekeys, TString*);
+}
+
+static void snap_error(lua_State *L, const char *what) {
+    luaO_pushfstring(L, "cannot snapshot %s", what);
+    luaD_throw(L, LUA_ERRRUN);
+}
+
+static int snap_add(lua_State *L, SnapState *ss, GCObject *o) {
+    int id = ss->nobj;
+    luaM_growvector(L, ss->obj, ss->nobj, ss->sizeobj, SnapObj, INT_MAX - 2, "snapshot too large");
+    ss->obj[id].o = o;
+    ss->obj[id].name = -1;
+    ss->obj[id].h = NULL;
+    ss->nobj++;
+    snap_insert(L, &ss->map, o, id);
+    return id;
+}
+
+// C 函数在可执行文件中的相对位置, 同一个程序的不同进程之间不变
+#define snap_cfunc(f)(cast(size_t,f)-cast(size_t,lua_restore))
+
+static int snap_keycmp(const void *a, const void *b) {
+    const TString *l = *(const TString *const *) a;
+    const TString *r = *(const TString *const *) b;
+    size_t n = l->tsv.len < r->tsv.len ? l->tsv.len : r->tsv.len;
+    int c = memcmp(getstr(l), getstr(r), n);
+    return c != 0 ? c : (l->tsv.len > r->tsv.len) - (l->tsv.len < r->tsv.len);
+}
+
+// 给对象 id 增加一条命名路径: 前 d-1 段取自对象 parent 的第一条路径, 最后一段是 key
+static void snap_addpath(lua_State *L, SnapState *ss, int id, int parent, int d, TString *key) {
+    SnapName *nm;
+    int k;
+    if (ss->obj[id].name < 0) {
+        luaM_growvector(L, ss->names, ss->nnames, ss->sizenames, SnapName, INT_MAX - 2, "snapshot too large");
+        ss->names[ss->nnames].npath = 0;
+        ss->obj[id].name = ss->nnames++;
+    }
+    nm = &ss->names[ss->obj[id].name];
+    if (nm->npath == SNAP_PATHS) return;
+    for (k = 0; k < d - 1; k++) nm->seg[nm->npath][k] = ss->names[ss->obj[parent].name].seg[0][k];
+    if (d > 0) nm->seg[nm->npath][d - 1] = key;
+    nm->nseg[nm->npath++] = d;
+}
+
+// 按层遍历注册表的字符串键, 给 C 函数, userdata 和表取名字. 同一层内按键排序,
+// 所以名字只取决于键, 与哈希表里的存放顺序无关
+static void snap_names(lua_State *L, SnapState *ss) {
+    int first = 0, last, d, i, j;
+    snap_addpath(L, ss, snap_add(L, ss, gcvalue(registry(L))), 0, 0, NULL);
+    for (d = 1; d <= SNAP_DEPTH; d++) {
+        last = ss->nobj;
+        for (i = first; i < last; i++) {
+            Table *t;
+            int n = 0;
+            if (ss->obj[i].o->gch.tt != LUA_TTABLE) continue;
+            t = gco2h(ss->obj[i].o);
+            for (j = sizenode(t) - 1; j >= 0; j--) {
+                Node *nd = gnode(t, j);
+                if (!ttisstring(gkey(nd))) continue;
+                if (!ttistable(gval(nd)) && !iscfunction(gval(nd)) && !ttisuserdata(gval(nd))) continue;
+                luaM_growvector(L, ss->keys, n, ss->sizekeys, TString*, INT_MAX - 2, "snapshot too large");
+                ss->keys[n++] = rawtsvalue(gkey(nd));
+            }
+            qsort(ss->keys, n, sizeof(TString *), snap_keycmp);
+            for (j = 0; j < n; j++) {
+                GCObject *o = gcvalue(luaH_getstr(t, ss->keys[j]));
+                int id = snap_find(&ss->map, o);
+                if (id < 0) id = snap_add(L, ss, o);
+                snap_addpath(L, ss, id, i, d, ss->keys[j]);
+            }
+        }
+        first = last;
+    }
+}
+
+static void snap_mark(lua_State *L, SnapState *ss, const TValue *o) {
+    switch (ttype(o)) {
+        case LUA_TNIL:
+        case LUA_TBOOLEAN:
+        case LUA_TNUMBER:
+        case LUA_TSTRING:
+            return;
+        case LUA_TTABLE:
+            break;
+        case LUA_TFUNCTION:
+            if (clvalue(o)->c.isC && snap_find(&ss->map, gcvalue(o)) < 0)
+                snap_error(L, "a C function not reachable from a library");
+            break;
+        case LUA_TUSERDATA:
+            if (snap_find(&ss->map, gcvalue(o)) < 0)
+                snap_error(L, "a userdata not reachable from a library");
+            break;
+        default:
+            snap_error(L, luaT_typenames[ttype(o)]);
+            break;
+    }
+    if (snap_find(&ss->map, gcvalue(o)) < 0) snap_add(L, ss, gcvalue(o));
+}
+
+// 广度优先遍历所有可达对象, 命名过的 C 函数和 userdata 不再展开
+static void snap_collect(lua_State *L, SnapState *ss) {
+    int i, j;
+    for (i = 0; i < ss->nobj; i++) {
+        GCObject *o = ss->obj[i].o;
+        switch (o->gch.tt) {
+            case LUA_TTABLE: {
+                Table *t = gco2h(o);
+                TValue mt;
+                if (t->metatable != NULL) {
+                    sethvalue(L, &mt, t->metatable);
+                    snap_mark(L, ss, &mt);
+                }
+                for (j = 0; j < t->sizearray; j++) snap_mark(L, ss, &t->array[j]);
+                for (j = sizenode(t) - 1; j >= 0; j--) {
+                    Node *nd = gnode(t, j);
+                    if (ttisnil(gval(nd))) continue;
+                    snap_mark(L, ss, key2tval(nd));
+                    snap_mark(L, ss, gval(nd));
+                }
+                break;
+            }
+            case LUA_TFUNCTION: {
+                Closure *cl = gco2cl(o);
+                TValue env;
+                if (cl->c.isC) break;
+                if (snap_find(&ss->map, cl->l.p) < 0) snap_add(L, ss, obj2gco(cl->l.p));
+                sethvalue(L, &env, cl->l.env);
+                snap_mark(L, ss, &env);
+                for (j = 0; j < cl->l.nupvalues; j++)
+                    if (snap_find(&ss->map, cl->l.upvals[j]) < 0) snap_add(L, ss, obj2gco(cl->l.upvals[j]));
+                break;
+            }
+            case (8 + 2):
+                snap_mark(L, ss, gco2uv(o)->v);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void DumpValue(SnapState *ss, const TValue *o) {
+    DumpState *D = &ss->u.D;
+    switch (ttype(o)) {
+        case LUA_TNIL:
+            DumpByte(SV_NIL, D);
+            break;
+        case LUA_TBOOLEAN:
+            DumpByte(bvalue(o) ? SV_TRUE : SV_FALSE, D);
+            break;
+        case LUA_TNUMBER: {
+            lua_Number n = nvalue(o);
+            // 32 位以内的整数值 (不含 -0) 用 zigzag 变长编码
+            if (n == floor(n) && fabs(n) < 2147483648.0 && (n != 0 || 1 / n > 0)) {
+                ptrdiff_t i = cast(ptrdiff_t, n);
+                DumpByte(SV_INT, D);
+                DumpSize(i < 0 ? ~(cast(size_t, i) << 1) : cast(size_t, i) << 1, D);
+            } else {
+                DumpByte(SV_NUMBER, D);
+                DumpNumber(n, D);
+            }
+            break;
+        }
+        case LUA_TSTRING: {
+            int i = snap_find(&ss->strs, rawtsvalue(o));
+            if (i >= 0) {
+                DumpByte(SV_STRREF, D);
+                DumpInt(i, D);
+            } else {
+                snap_insert(ss->u.D.L, &ss->strs, rawtsvalue(o), ss->nstr++);
+                DumpByte(SV_STRING, D);
+                DumpString(rawtsvalue(o), D);
+            }
+            break;
+        }
+        default:
+            DumpByte(SV_REF, D);
+            DumpInt(snap_find(&ss->map, gcvalue(o)), D);
+            break;
+    }
+}
+
+static void f_snapshot(lua_State *L, void *ud) {
+    SnapState *ss = cast(SnapState *, ud);
+    DumpState *D = &ss->u.D;
+    char h[LUAC_HEADERSIZE];
+    TValue v;
+    int i, j;
+    snap_names(L, ss);
+    snap_mark(L, ss, gt(L));
+    for (i = 0; i < (8 + 1); i++)
+        if (G(L)->mt[i] != NULL) {
+            sethvalue(L, &v, G(L)->mt[i]);
+            snap_mark(L, ss, &v);
+        }
+    snap_collect(L, ss);
+    luaU_header(h, LUAC_SNAPSHOT);
+    DumpBlock(h, LUAC_HEADERSIZE, D);
+    DumpInt(ss->nobj, D);
+    for (i = 0; i < ss->nobj; i++) {
+        SnapObj *so = &ss->obj[i];
+        if (so->name >= 0) {
+            SnapName *nm = &ss->names[so->name];
+            int k;
+            DumpByte(SN_NAMED, D);
+            DumpByte(so->o->gch.tt, D);
+            if (so->o->gch.tt == LUA_TFUNCTION) DumpSize(snap_cfunc(gco2cl(so->o)->c.f), D);
+            DumpByte(nm->npath, D);
+            for (j = 0; j < nm->npath; j++) {
+                DumpByte(nm->nseg[j], D);
+                for (k = 0; k < nm->nseg[j]; k++) DumpString(nm->seg[j][k], D);
+            }
+            continue;
+        }
+        switch (so->o->gch.tt) {
+            case LUA_TTABLE: {
+                Table *t = gco2h(so->o);
+                int n = 0;
+                for (j = sizenode(t) - 1; j >= 0; j--) n += !ttisnil(gval(gnode(t, j)));
+                DumpByte(SN_TABLE, D);
+                DumpInt(t->sizearray, D);
+                DumpInt(n, D);
+                break;
+            }
+            case LUA_TFUNCTION:
+                DumpByte(SN_CLOSURE, D);
+                DumpByte(gco2cl(so->o)->l.nupvalues, D);
+                break;
+            case (8 + 2):
+                DumpByte(SN_UPVAL, D);
+                break;
+            default:
+                DumpByte(SN_PROTO, D);
+                DumpFunction(gco2p(so->o), NULL, D);
+                break;
+        }
+    }
+    for (i = 0; i < ss->nobj; i++) {
+        GCObject *o = ss->obj[i].o;
+        switch (o->gch.tt) {
+            case LUA_TTABLE: {
+                Table *t = gco2h(o);
+                int n = 0;
+                if (t->metatable != NULL) {
+                    sethvalue(L, &v, t->metatable);
+                } else {
+                    setnilvalue(&v);
+                }
+                DumpValue(ss, &v);
+                DumpInt(t->sizearray, D);
+                for (j = 0; j < t->sizearray; j++) DumpValue(ss, &t->array[j]);
+                for (j = sizenode(t) - 1; j >= 0; j--) n += !ttisnil(gval(gnode(t, j)));
+                DumpInt(n, D);
+                for (j = sizenode(t) - 1; j >= 0; j--) {
+                    Node *nd = gnode(t, j);
+                    if (ttisnil(gval(nd))) continue;
+                    DumpValue(ss, key2tval(nd));
+                    DumpValue(ss, gval(nd));
+                }
+                break;
+            }
+            case LUA_TFUNCTION: {
+                Closure *cl = gco2cl(o);
+                if (cl->c.isC) break;
+                DumpInt(snap_find(&ss->map, cl->l.p), D);
+                sethvalue(L, &v, cl->l.env);
+                DumpValue(ss, &v);
+                for (j = 0; j < cl->l.nupvalues; j++) DumpInt(snap_find(&ss->map, cl->l.upvals[j]), D);
+                break;
+            }
+            case (8 + 2):
+                DumpValue(ss, gco2uv(o)->v);
+                break;
+            default:
+                break;
+        }
+    }
+    DumpValue(ss, gt(L));
+    for (i = 0; i < (8 + 1); i++) {
+        if (G(L)->mt[i] != NULL) {
+            sethvalue(L, &v, G(L)->mt[i]);
+        } else {
+            setnilvalue(&v);
+        }
+        DumpValue(ss, &v);
+    }
+    if (D->status != 0) snap_error(L, "(write error)");
+}
+
+static GCObject *LoadRef(SnapState *ss, int tt) {
+    int id = LoadInt(&ss->u.S);
+    if (id >= ss->nobj || ss->obj[id].o->gch.tt != tt) LoadError(&ss->u.S, "bad reference");
+    return ss->obj[id].o;
+}
+
+static void LoadValue(SnapState *ss, TValue *o) {
+    LoadState *S = &ss->u.S;
+    switch (LoadByte(S)) {
+        case SV_NIL:
+            setnilvalue(o);
+            break;
+        case SV_FALSE:
+            setbvalue(o, 0);
+            break;
+        case SV_TRUE:
+            setbvalue(o, 1);
+            break;
+        case SV_NUMBER:
+            setnvalue(o, LoadNumber(S));
+            break;
+        case SV_INT: {
+            size_t u = LoadSize(S);
+            setnvalue(o, cast_num((u & 1) ? ~cast(ptrdiff_t, u >> 1) : cast(ptrdiff_t, u >> 1)));
+            break;
+        }
+        case SV_STRING: {
+            TString *ts = LoadString(S);
+            if (ts == NULL) LoadError(S, "bad string");
+            luaM_growvector(S->L, ss->str, ss->nstr, ss->sizestr, TString*, INT_MAX - 2, "snapshot too large");
+            ss->str[ss->nstr++] = ts;
+            setsvalue(S->L, o, ts);
+            break;
+        }
+        case SV_STRREF: {
+            int i = LoadInt(S);
+            if (i >= ss->nstr) LoadError(S, "bad string");
+            setsvalue(S->L, o, ss->str[i]);
+            break;
+        }
+        case SV_REF: {
+            int id = LoadInt(S);
+            GCObject *p;
+            if (id >= ss->nobj) LoadError(S, "bad reference");
+            p = ss->obj[id].o;
+            switch (p->gch.tt) {
+                case LUA_TTABLE:
+                    sethvalue(S->L, o, gco2h(p));
+                    break;
+                case LUA_TFUNCTION:
+                    setclvalue(S->L, o, gco2cl(p));
+                    break;
+                case LUA_TUSERDATA:
+                    setuvalue(S->L, o, rawgco2u(p));
+                    break;
+                default:
+                    LoadError(S, "bad reference");
+                    break;
+            }
+            break;
+        }
+        default:
+            LoadError(S, "bad value");
+            break;
+    }
+}
+
+// 按路径在注册表中找回命名对象. C 函数优先选代码地址 (相对 lua_restore 的偏移) 与快照时相同的那条路径,
+// 这样即使库函数在快照前被赋给了别的名字也能找对; 找不到的表 (或已被别的名字占用的表) 新建一个
+static GCObject *LoadNamed(lua_State *L, SnapState *ss, SnapMap *used) {
+    LoadState *S = &ss->u.S;
+    int tt = LoadByte(S);
+    size_t cf = (tt == LUA_TFUNCTION) ? LoadSize(S) : 0;
+    int npath = LoadByte(S);
+    GCObject *found = NULL;
+    TString *name = NULL;
+    int exact = 0;
+    if (npath == 0 || npath > SNAP_PATHS) LoadError(S, "bad name");
+    while (npath-- > 0) {
+        const TValue *o = registry(L);
+        int n = LoadByte(S);
+        if (n > SNAP_DEPTH) LoadError(S, "bad name");
+        while (n-- > 0) {
+            TString *seg = LoadString(S);
+            if (seg == NULL) LoadError(S, "bad name");
+            if (name == NULL && n == 0) name = seg;
+            o = ttistable(o) ? luaH_getstr(hvalue(o), seg) : (&luaO_nilObject_);
+        }
+        if (exact || ttype(o) != tt) continue;
+        if (tt == LUA_TTABLE && snap_find(used, gcvalue(o)) >= 0) continue;
+        if (tt == LUA_TFUNCTION) {
+            if (!clvalue(o)->c.isC) continue;
+            exact = (snap_cfunc(clvalue(o)->c.f) == cf);
+            if (!exact && found != NULL) continue;
+        }
+        found = gcvalue(o);
+        if (tt != LUA_TFUNCTION) exact = 1;
+    }
+    if (found == NULL) {
+        if (tt != LUA_TTABLE)
+            LoadError(S, luaO_pushfstring(L, "missing library value " LUA_QL("%s"), name ? getstr(name) : "?"));
+        return obj2gco(luaH_new(L, 0, 0));
+    }
+    if (tt == LUA_TTABLE) snap_insert(L, used, found, 0);
+    return found;
+}
+
+// 把 h 的内容换进正在使用的表 t, 只交换指针和大小, h 带着旧内容等待回收
+static void snap_swap(lua_State *L, Table *t, Table *h) {
+    Table old = *t;
+    t->lsizenode = h->lsizenode;
+    t->metatable = h->metatable;
+    t->array = h->array;
+    t->node = h->node;
+#ifdef LUA_USE_SWISS
+    t->growth = h->growth;
+#else
+    t->lastfree = h->lastfree;
+#endif
+    t->sizearray = h->sizearray;
+    t->border = h->border;
+    t->flags = 0;
+    h->lsizenode = old.lsizenode;
+    h->metatable = old.metatable;
+    h->array = old.array;
+    h->node = old.node;
+#ifdef LUA_USE_SWISS
+    h->growth = old.growth;
+#else
+    h->lastfree = old.lastfree;
+#endif
+    h->sizearray = old.sizearray;
+    h->border = old.border;
+    if (isblack(obj2gco(t))) luaC_barrierback(L, t);
+}
+
+static void f_restore(lua_State *L, void *ud) {
+    SnapState *ss = cast(SnapState *, ud);
+    LoadState *S = &ss->u.S;
+    char hd[LUAC_HEADERSIZE];
+    char s[LUAC_HEADERSIZE];
+    Table *mt[8 + 1];
+    TValue k, v;
+    int i, j, m, n;
+    luaU_header(hd, LUAC_SNAPSHOT);
+    LoadBlock(S, s, LUAC_HEADERSIZE);
+    if (memcmp(hd, s, LUAC_HEADERSIZE) != 0) LoadError(S, "bad header");
+    n = LoadInt(S);
+    if (n == 0) LoadError(S, "bad header");
+    ss->obj = luaM_newvector(L, n, SnapObj);
+    ss->sizeobj = n;
+    for (i = 0; i < n; i++) {
+        GCObject *o;
+        Table *h = NULL;
+        switch (LoadByte(S)) {
+            case SN_NAMED:
+                o = LoadNamed(L, ss, &ss->map);
+                if (o->gch.tt == LUA_TTABLE) h = luaH_new(L, 0, 0);
+                break;
+            case SN_TABLE: {
+                int na = LoadInt(S);
+                o = obj2gco(luaH_new(L, na, LoadInt(S)));
+                break;
+            }
+            case SN_CLOSURE: {
+                // 原型和上值在第二遍才填, 在此之前闭包不会被任何存活对象引用到
+                Closure *cl = luaF_newLclosure(L, LoadByte(S), hvalue(gt(L)));
+                cl->l.p = NULL;
+                o = obj2gco(cl);
+                break;
+            }
+            case SN_UPVAL:
+                o = obj2gco(luaF_newupval(L));
+                break;
+            case SN_PROTO:
+                o = obj2gco(LoadFunction(S, luaS_newlstr(L, "=?", 2)));
+                break;
+            default:
+                LoadError(S, "bad object");
+                return;
+        }
+        ss->obj[i].o = o;
+        ss->obj[i].h = h;
+        ss->nobj = i + 1;
+    }
+    if (ss->obj[0].o != gcvalue(registry(L))) LoadError(S, "bad registry");
+    // 第二遍读入内容: 新建的对象此时还不可达, 直接填; 命名表的内容填进它的临时表.
+    // 快照被截断或损坏时在这一遍就会出错, 原有的注册表, 全局表和库表都还没有动过
+    for (i = 0; i < n; i++) {
+        GCObject *o = ss->obj[i].o;
+        switch (o->gch.tt) {
+            case LUA_TTABLE: {
+                Table *t = ss->obj[i].h != NULL ? ss->obj[i].h : gco2h(o);
+                LoadValue(ss, &v);
+                if (!ttisnil(&v) && !ttistable(&v)) LoadError(S, "bad metatable");
+                t->metatable = ttisnil(&v) ? NULL : hvalue(&v);
+                if (t->metatable) luaC_objbarriert(L, t, t->metatable);
+                for (j = 0, m = LoadInt(S); j < m; j++) {
+                    LoadValue(ss, &v);
+                    if (ttisnil(&v)) continue;
+                    setobj(L, luaH_setnum(L, t, j + 1), &v);
+                    luaC_barriert(L, t, &v);
+                }
+                for (j = LoadInt(S); j > 0; j--) {
+                    LoadValue(ss, &k);
+                    LoadValue(ss, &v);
+                    if (ttisnil(&k) || (ttisnumber(&k) && luai_numisnan(nvalue(&k)))) LoadError(S, "bad key");
+                    setobj(L, luaH_set(L, t, &k), &v);
+                    luaC_barriert(L, t, &k);
+                    luaC_barriert(L, t, &v);
+                }
+                t->flags = 0;
+                break;
+            }
+            case LUA_TFUNCTION: {
+                Closure *cl = gco2cl(o);
+                if (cl->c.isC) break;
+                cl->l.p = gco2p(LoadRef(ss, (8 + 1)));
+                if (cl->l.p->nups != cl->l.nupvalues) LoadError(S, "bad closure");
+                LoadValue(ss, &v);
+                if (!ttistable(&v)) LoadError(S, "bad environment");
+                cl->l.env = hvalue(&v);
+                for (j = 0; j < cl->l.nupvalues; j++) cl->l.upvals[j] = gco2uv(LoadRef(ss, (8 + 2)));
+                break;
+            }
+            case (8 + 2):
+                LoadValue(ss, &v);
+                setobj(L, gco2uv(o)->v, &v);
+                luaC_barrier(L, gco2uv(o), &v);
+                break;
+            default:
+                break;
+        }
+    }
+    LoadValue(ss, &v);
+    if (!ttistable(&v)) LoadError(S, "bad globals");
+    for (i = 0; i < (8 + 1); i++) {
+        LoadValue(ss, &k);
+        if (!ttisnil(&k) && !ttistable(&k)) LoadError(S, "bad metatable");
+        mt[i] = ttisnil(&k) ? NULL : hvalue(&k);
+    }
+    // 整个快照都已读完并通过检查, 下面只交换指针, 不会再出错
+    for (i = 0; i < n; i++)
+        if (ss->obj[i].h != NULL) snap_swap(L, gco2h(ss->obj[i].o), ss->obj[i].h);
+    sethvalue(L, gt(L), hvalue(&v));
+    for (i = 0; i < (8 + 1); i++) G(L)->mt[i] = mt[i];
+}
+
+#define opmode(t, a, b, c, m)(((t)<<7)|((a)<<6)|((b)<<4)|((c)<<2)|(m))
+static const lu_byte luaP_opmodes[NUM_OPCODES] = {
+        opmode(0, 1, OpArgR, OpArgN, iABC), opmode(0, 1, OpArgK, OpArgN, iABx), opmode(0, 1, OpArgU, OpArgU, iABC),
+        opmode(0, 1, OpArgR, OpArgN, iABC), opmode(0, 1, OpArgU, OpArgN, iABC), opmode(0, 1, OpArgK, OpArgN, iABx),
+        opmode(0, 1, OpArgR, OpArgK, iABC), opmode(0, 0, OpArgK, OpArgN, iABx), opmode(0, 0, OpArgU, OpArgN, iABC),
+        opmode(0, 0, OpArgK, OpArgK, iABC), opmode(0, 1, OpArgU, OpArgU, iABC), opmode(0, 1, OpArgR, OpArgK, iABC),
+        opmode(0, 1, OpArgK, OpArgK, iABC), opmode(0, 1, OpArgK, OpArgK, iABC), opmode(0, 1, OpArgK, OpArgK, iABC),
+        opmode(0, 1, OpArgK, OpArgK, iABC), opmode(0, 1, OpArgK, OpArgK, iABC), opmode(0, 1, OpArgK, OpArgK, iABC),
+        opmode(0, 1, OpArgR, OpArgN, iABC), opmode(0, 1, OpArgR, OpArgN, iABC), opmode(0, 1, OpArgR, OpArgN, iABC),
+        opmode(0, 1, OpArgR, OpArgR, iABC), opmode(0, 0, OpArgR, OpArgN, iAsBx), opmode(1, 0, OpArgK, OpArgK, iABC),
+        opmode(1, 0, OpArgK, OpArgK, iABC), opmode(1, 0, OpArgK, OpArgK, iABC), opmode(1, 1, OpArgR, OpArgU, iABC),
+        opmode(1, 1, OpArgR, OpArgU, iABC), opmode(0, 1, OpArgU, OpArgU, iABC), opmode(0, 1, OpArgU, OpArgU, iABC),
+        opmode(0, 0, OpArgU, OpArgN, iABC), opmode(0, 1, OpArgR, OpArgN, iAsBx), opmode(0, 1, OpArgR, OpArgN, iAsBx),
+        opmode(1, 0, OpArgN, OpArgU, iABC), opmode(0, 0, OpArgU, OpArgU, iABC), opmode(0, 0, OpArgN, OpArgN, iABC),
+        opmode(0, 1, OpArgU, OpArgN, iABx), opmode(0, 1, OpArgU, OpArgN, iABC), opmode(0, 1, OpArgR, OpArgK, iABC),
+        opmode(0, 1, OpArgR, OpArgR, iABC), opmode(0, 1, OpArgR, OpArgR, iABC), opmode(0, 1, OpArgR, OpArgR, iABC),
+        opmode(0, 1, OpArgR, OpArgR, iABC), opmode(0, 1, OpArgR, OpArgR, iABC), opmode(0, 1, OpArgR, OpArgR, iABC),
+        opmode(0, 1, OpArgR, OpArgK, iABC), opmode(0, 1, OpArgR, OpArgK, iABC), opmode(0, 1, OpArgR, OpArgK, iABC),
+        opmode(0, 1, OpArgR, OpArgK, iABC), opmode(0, 1, OpArgR, OpArgK, iABC), opmode(0, 1, OpArgR, OpArgK, iABC)
+};
+#define next(ls)(ls->current=zgetc(ls->z))
+#define currIsNewline(ls)(ls->current=='\n'||ls->current=='\r')
+static const char *const luaX_tokens[] = {
+        "and", "break", "do", "else", "elseif",
+        "end", "false", "for", "function", "if",
+        "in", "local", "nil", "not", "or", "repeat",
+        "return", "then", "true", "until", "while",
+        "..", "...", "==", ">=", "<=", "~=",
+        "<number>", "<name>", "<string>", "<eof>",
+        NULL
+};
+#define save_and_next(ls)(save(ls,ls->current),next(ls))
+
+static void save(LexState *ls, int c) {
+    MBuffer *b = ls->buff;
+    if (b->n + 1 > b->buffsize) {
+        size_t newsize;
+        if (b->buffsize >= ((size_t) (~(size_t) 0) - 2) / 2)
+            luaX_lexerror(ls, "lexical element too long", 0);
+        newsize = b->buffsize * 2;
+        luaZ_resizebuffer(ls->L, b, newsize);
+    }
+    b->buffer[b->n++] = cast(char, c);
+}
+
+static void luaX_init(lua_State *L) {
+    int i;
+    for (i = 0; i < (cast(int, TK_WHILE - 257 + 1)); i++) {
+        TString *ts = luaS_new(L, luaX_tokens[i]);
+        luaS_fix(ts);
+        ts->tsv.reserved = cast_byte(i + 1);
+    }
+}
+
+static const char *luaX_token2str(LexState *ls, int token) {
+    if (token < 257) {
+        return (iscntrl(token)) ? luaO_pushfstring(ls->L, "char(%d)", token) :
+               luaO_pushfstring(ls->L, "%c", token);
+    } else
+        return luaX_tokens[token - 257];
+}
+
+static const char *txtToken(LexState *ls, int token) {
+    switch (token) {
+        case TK_NAME:
+        case TK_STRING:
+        case TK_NUMBER:
+            save(ls, '\0');
+            return luaZ_buffer(ls->buff);
+        default:
+            return luaX_token2str(ls, token);
+    }
+}
+
+static void luaX_lexerror(LexState *ls, const char *msg, int token) {
+    char buff[80];
+    luaO_chunkid(buff, getstr(ls->source), 80);
+    msg = luaO_pushfstring(ls->L, "%s:%d: %s", buff, ls->linenumber, msg);
     if (token)
         luaO_pushfstring(ls->L, "%s near "LUA_QL("%s"), msg, txtToken(ls, token));
     luaD_throw(ls->L, 3);
@@ -3441,9 +5937,10 @@ static void luaK_dischargevars(FuncState *fs, expdesc *e) {
             break;
         }
         case VINDEXED: {
+            OpCode op = (ISK(e->u.s.aux) && ttisstring(&fs->f->k[INDEXK(e->u.s.aux)])) ? OP_GETFIELD : OP_GETTABLE;
             freereg(fs, e->u.s.aux);
             freereg(fs, e->u.s.info);
-            e->u.s.info = luaK_codeABC(fs, OP_GETTABLE, 0, e->u.s.info, e->u.s.aux);
+            e->u.s.info = luaK_codeABC(fs, op, 0, e->u.s.info, e->u.s.aux);
             e->k = VRELOCABLE;
             break;
         }
@@ -3774,6 +6271,87 @@ static int constfolding(OpCode op, expdesc *e1, expdesc *e2) {
     return 1;
 }
 
+// 取出常量表达式的值, 表达式不是没有跳转链的常量时返回 0
+static int constvalue(FuncState *fs, expdesc *e, TValue *v) {
+    if (e->t != (-1) || e->f != (-1))return 0;
+    switch (e->k) {
+        case VNIL:
+            setnilvalue(v);
+            return 1;
+        case VTRUE:
+            setbvalue(v, 1);
+            return 1;
+        case VFALSE:
+            setbvalue(v, 0);
+            return 1;
+        case VKNUM:
+            setnvalue(v, e->u.nval);
+            return 1;
+        case VK:
+            setobj(fs->L, v, &fs->f->k[e->u.s.info]);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// 两个常量的比较在编译期完成: ==/~= 适用于所有常量, </<= 只折叠数字 (字符串的大小依赖运行时的 strcoll)
+static int constcompare(FuncState *fs, OpCode op, int cond, expdesc *e1, expdesc *e2) {
+    TValue v1, v2;
+    int res;
+    if (!constvalue(fs, e1, &v1) || !constvalue(fs, e2, &v2))return 0;
+    if (op == OP_EQ)
+        res = luaO_rawEqualObj(&v1, &v2) == cond;
+    else if (ttisnumber(&v1) && ttisnumber(&v2)) {
+        lua_Number a = nvalue(cond ? &v1 : &v2), b = nvalue(cond ? &v2 : &v1);
+        res = op == OP_LT ? luai_numlt(a, b) : luai_numle(a, b);
+    } else
+        return 0;
+    e1->k = res ? VTRUE : VFALSE;
+    return 1;
+}
+
+// 把常量转成拼接时的字符串形式 (与运行时的 luaV_tostring 一致)
+static const char *conststring(TValue *v, char *buff, size_t *len) {
+    if (ttisstring(v)) {
+        *len = tsvalue(v)->len;
+        return svalue(v);
+    }
+    lua_number2str(buff, nvalue(v));
+    *len = strlen(buff);
+    return buff;
+}
+
+// 左操作数已经被 luaK_infix 用 LOADK 放进寄存器; 右操作数也是字符串或数字常量且这条 LOADK 不是跳转目标时,
+// 撤销 LOADK, 把两者在编译期拼成一个字符串常量
+static int constconcat(FuncState *fs, expdesc *e1, expdesc *e2) {
+    Instruction *last = &fs->f->code[fs->pc - 1];
+    TValue v1, v2;
+    char b1[32], b2[32];
+    const char *s1, *s2;
+    size_t l1, l2;
+    char *buff;
+    TString *ts;
+    if (e1->k != VNONRELOC || e1->t != (-1) || e1->f != (-1) || fs->pc - 1 <= fs->lasttarget ||
+        GET_OPCODE(*last) != OP_LOADK || GETARG_A(*last) != e1->u.s.info || e1->u.s.info != fs->freereg - 1)
+        return 0;
+    setobj(fs->L, &v1, &fs->f->k[GETARG_Bx(*last)]);
+    if (!constvalue(fs, e2, &v2) || !(ttisstring(&v1) || ttisnumber(&v1)) || !(ttisstring(&v2) || ttisnumber(&v2)))
+        return 0;
+    s1 = conststring(&v1, b1, &l1);
+    s2 = conststring(&v2, b2, &l2);
+    // 借用词法分析器的缓冲区拼接: 每个记号开始时都会重置它, 出错时由 luaD_protectedparser 统一释放
+    buff = luaZ_openspace(fs->L, fs->ls->buff, l1 + l2);
+    if (l1 > 0) memcpy(buff, s1, l1);
+    if (l2 > 0) memcpy(buff + l1, s2, l2);
+    ts = luaS_newlstr(fs->L, buff, l1 + l2);
+    fs->pc--;
+    freeexp(fs, e1);
+    e1->k = VK;
+    e1->u.s.info = luaK_stringK(fs, ts);
+    return 1;
+}
+
 static void codearith(FuncState *fs, OpCode op, expdesc *e1, expdesc *e2) {
     if (constfolding(op, e1, e2))
         return;
@@ -3794,8 +6372,11 @@ static void codearith(FuncState *fs, OpCode op, expdesc *e1, expdesc *e2) {
 
 static void codecomp(FuncState *fs, OpCode op, int cond, expdesc *e1,
                      expdesc *e2) {
-    int o1 = luaK_exp2RK(fs, e1);
-    int o2 = luaK_exp2RK(fs, e2);
+    int o1, o2;
+    if (constcompare(fs, op, cond, e1, e2))
+        return;
+    o1 = luaK_exp2RK(fs, e1);
+    o2 = luaK_exp2RK(fs, e2);
     freeexp(fs, e2);
     freeexp(fs, e1);
     if (cond == 0 && op != OP_EQ) {
@@ -3825,6 +6406,12 @@ static void luaK_prefix(FuncState *fs, UnOpr op, expdesc *e) {
             codenot(fs, e);
             break;
         case OPR_LEN: {
+            TValue v;
+            if (constvalue(fs, e, &v) && ttisstring(&v)) {     // 字符串常量的长度
+                e->k = VKNUM;
+                e->u.nval = cast_num(tsvalue(&v)->len);
+                break;
+            }
             luaK_exp2anyreg(fs, e);
             codearith(fs, OP_LEN, e, &e2);
             break;
@@ -3856,8 +6443,9 @@ static void luaK_infix(FuncState *fs, BinOpr op, expdesc *v) {
             if (!isnumeral(v))luaK_exp2RK(fs, v);
             break;
         }
-        default: {
-            luaK_exp2RK(fs, v);
+        default: {      // 比较: 常量留到 luaK_posfix 里再决定是否折叠
+            TValue k;
+            if (!constvalue(fs, v, &k))luaK_exp2RK(fs, v);
             break;
         }
     }
@@ -3878,6 +6466,8 @@ static void luaK_posfix(FuncState *fs, BinOpr op, expdesc *e1, expdesc *e2) {
             break;
         }
         case OPR_CONCAT: {
+            if (constconcat(fs, e1, e2))
+                break;
             luaK_exp2val(fs, e2);
             if (e2->k == VRELOCABLE && GET_OPCODE(getcode(fs, e2)) == OP_CONCAT) {
                 freeexp(fs, e1);
@@ -4238,12 +6828,160 @@ static void open_func(LexState *ls, FuncState *fs) {
     incr_top(L);
 }
 
+#define PH_DATA 1       // CLOSURE 的上值描述或 SETLIST 的扩展参数, 不是指令
+#define PH_LIVE 2       // 可达, 需要保留
+#define PH_PINNED 4     // 被 LOADBOOL 跳过或紧跟在比较之后的指令, 位置不能变
+#define PH_TARGET 8     // 跳转目标
+#define ph_target(code, pc)((pc)+1+GETARG_sBx((code)[pc]))
+#define ph_push(pc){if((pc)<n&&!(flags[pc]&PH_LIVE)){flags[pc]|=PH_LIVE;work[nwork++]=(pc);}}
+
+// 收尾时对字节码做一遍窥孔优化: 跳到 OP_JMP 的跳转直接改到最终目标, 删除不可达的指令、
+// 跳到下一条指令的 OP_JMP 以及函数入口处多余的 LOADNIL (入口处的空闲寄存器已经是 nil),
+// 最后压缩代码并同步 lineinfo、局部变量的 pc 区间和所有跳转偏移
+static void luaK_peephole(FuncState *fs) {
+    lua_State *L = fs->L;
+    Proto *f = fs->f;
+    Instruction *code = f->code;
+    int n = fs->pc;
+    int *flags = luaM_newvector(L, 3 * n + 1, int);
+    int *map = flags + n;
+    int *work = map + n + 1;
+    int pc, np, nwork = 0, changed;
+    lu_byte written[256];
+    for (pc = 0; pc < n; pc++) flags[pc] = 0;
+    for (pc = 0; pc < n; pc++) {
+        Instruction i = code[pc];
+        if (GET_OPCODE(i) == OP_CLOSURE) {
+            int j, nup = f->p[GETARG_Bx(i)]->nups;
+            for (j = 1; j <= nup; j++) flags[pc + j] |= PH_DATA;
+            pc += nup;
+        } else if (GET_OPCODE(i) == OP_SETLIST && GETARG_C(i) == 0) {
+            flags[++pc] |= PH_DATA;
+        }
+    }
+    for (pc = 0; pc < n; pc++) {
+        if (!(flags[pc] & PH_DATA) && GET_OPCODE(code[pc]) == OP_JMP) {
+            int t = ph_target(code, pc), hops = 0;
+            while (t != pc && GET_OPCODE(code[t]) == OP_JMP && hops++ < n) t = ph_target(code, t);
+            SETARG_sBx(code[pc], t - pc - 1);
+        }
+    }
+    ph_push(0);
+    ph_push(n - 1);
+    while (nwork > 0) {
+        Instruction i = code[pc = work[--nwork]];
+        OpCode op = GET_OPCODE(i);
+        switch (op) {
+            case OP_JMP:
+            case OP_FORPREP:
+                flags[ph_target(code, pc)] |= PH_TARGET;
+                ph_push(ph_target(code, pc));
+                break;
+            case OP_FORLOOP:
+                flags[ph_target(code, pc)] |= PH_TARGET;
+                ph_push(ph_target(code, pc));
+                ph_push(pc + 1);
+                break;
+            case OP_RETURN:
+                break;
+            case OP_CLOSURE: {
+                int j, nup = f->p[GETARG_Bx(i)]->nups;
+                for (j = 1; j <= nup; j++) flags[pc + j] |= PH_LIVE;
+                ph_push(pc + 1 + nup);
+                break;
+            }
+            case OP_SETLIST:
+                if (GETARG_C(i) == 0) {
+                    flags[pc + 1] |= PH_LIVE;
+                    ph_push(pc + 2);
+                } else {
+                    ph_push(pc + 1);
+                }
+                break;
+            default:
+                if (testTMode(op) || (op == OP_LOADBOOL && GETARG_C(i))) {
+                    flags[pc + 1] |= PH_PINNED;
+                    flags[pc + 2] |= PH_TARGET;
+                    ph_push(pc + 1);
+                    ph_push(pc + 2);
+                } else {
+                    ph_push(pc + 1);
+                }
+                break;
+        }
+    }
+    for (pc = 0; pc < f->maxstacksize; pc++) written[pc] = cast_byte(pc < f->numparams);
+    for (pc = 0; pc < n && !(flags[pc] & PH_TARGET); pc++) {
+        Instruction i = code[pc];
+        int a = GETARG_A(i);
+        switch (GET_OPCODE(i)) {
+            case OP_LOADNIL: {
+                int r, b = GETARG_B(i), fresh = 1;
+                for (r = a; r <= b; r++) if (written[r]) fresh = 0;
+                if (fresh && !(flags[pc] & PH_PINNED)) flags[pc] &= ~PH_LIVE;
+                continue;
+            }
+            case OP_CLOSURE:
+                pc += f->p[GETARG_Bx(i)]->nups;
+                written[a] = 1;
+                continue;
+            case OP_LOADBOOL:
+                if (GETARG_C(i)) break;
+/*fallthrough*/
+            case OP_MOVE: case OP_LOADK: case OP_GETUPVAL: case OP_GETGLOBAL: case OP_GETTABLE:
+            case OP_GETFIELD: case OP_NEWTABLE: case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+            case OP_MOD: case OP_POW: case OP_UNM: case OP_NOT: case OP_LEN:
+                written[a] = 1;
+                continue;
+            case OP_SETGLOBAL: case OP_SETUPVAL: case OP_SETTABLE:
+                continue;
+            default:
+                break;
+        }
+        break;
+    }
+    do {
+        changed = 0;
+        for (pc = 0, np = 0; pc < n; pc++) {
+            map[pc] = np;
+            if (flags[pc] & PH_LIVE) np++;
+        }
+        map[n] = np;
+        for (pc = 0; pc < n - 1; pc++) {
+            if ((flags[pc] & (PH_LIVE | PH_DATA | PH_PINNED)) == PH_LIVE && GET_OPCODE(code[pc]) == OP_JMP &&
+                ph_target(code, pc) > pc && map[ph_target(code, pc)] == map[pc] + 1) {
+                flags[pc] &= ~PH_LIVE;
+                changed = 1;
+            }
+        }
+    } while (changed);
+    for (pc = 0, np = 0; pc < n; pc++) {
+        Instruction i = code[pc];
+        if (!(flags[pc] & PH_LIVE)) continue;
+        if (!(flags[pc] & PH_DATA)) {
+            OpCode op = GET_OPCODE(i);
+            if (op == OP_JMP || op == OP_FORLOOP || op == OP_FORPREP)
+                SETARG_sBx(i, map[ph_target(code, pc)] - np - 1);
+        }
+        code[np] = i;
+        f->lineinfo[np] = f->lineinfo[pc];
+        np++;
+    }
+    for (pc = 0; pc < fs->nlocvars; pc++) {
+        f->locvars[pc].startPc = map[f->locvars[pc].startPc];
+        f->locvars[pc].endPc = map[f->locvars[pc].endPc];
+    }
+    fs->pc = np;
+    luaM_freearray(L, flags, 3 * n + 1, int);
+}
+
 static void close_func(LexState *ls) {
     lua_State *L = ls->L;
     FuncState *fs = ls->fs;
     Proto *f = fs->f;
     removevars(ls, 0);
     luaK_ret(fs, 0, 0);
+    luaK_peephole(fs);
     luaM_reallocvector(L, f->code, f->sizecode, fs->pc, Instruction);
     f->sizecode = fs->pc;
     luaM_reallocvector(L, f->lineinfo, f->sizelineinfo, fs->pc, int);
@@ -4256,6 +6994,7 @@ static void close_func(LexState *ls) {
     f->sizelocvars = fs->nlocvars;
     luaM_reallocvector(L, f->upvalues, f->sizeupvalues, f->nups, TString*);
     f->sizeupvalues = f->nups;
+    luaF_initcache(L, f);
     ls->fs = fs->prev;
     if (fs)anchor_token(ls);
     L->top -= 2;
@@ -5383,207 +8122,360 @@ static void Arith(lua_State *L, StkId ra, const TValue *rb,
         luaG_aritherror(L, rb, rc);
 }
 
-#define runtime_check(L, c){if(!(c))break;}
+// GCC/Clang 下使用 computed goto: 每个指令的处理代码末尾各有一个独立的间接跳转,
+// 分支预测可以按指令学习; 定义 LUA_USE_SWITCH 可强制退回到 switch 分发
+#if defined(__GNUC__)&&!defined(LUA_USE_SWITCH)
+#define LUA_USE_JUMPTABLE
+#endif
+#ifdef LUA_USE_JUMPTABLE
+#define vmdispatch(o)goto*disptab[o];
+#define vmcase(l)L_##l:
+#define vmbreak {i=*pc++;ra=RA(i);vmdispatch(GET_OPCODE(i));}
+#else
+#define vmdispatch(o)switch(o)
+#define vmcase(l)case l:
+#define vmbreak continue
+#endif
+#define runtime_check(L, c){if(!(c))vmbreak;}
 #define RA(i)(base+GETARG_A(i))
 #define RB(i)check_exp(getBMode(GET_OPCODE(i))==OpArgR,base+GETARG_B(i))
 #define RKB(i)check_exp(getBMode(GET_OPCODE(i))==OpArgK,ISK(GETARG_B(i))?k+INDEXK(GETARG_B(i)):base+GETARG_B(i))
 #define RKC(i)check_exp(getCMode(GET_OPCODE(i))==OpArgK,ISK(GETARG_C(i))?k+INDEXK(GETARG_C(i)):base+GETARG_C(i))
 #define KBx(i)check_exp(getBMode(GET_OPCODE(i))==OpArgK,k+GETARG_Bx(i))
 #define dojump(L, pc, i){(pc)+=(i);}
+// 比较指令总是紧跟一条 OP_JMP, 在同一次分发里读出它的偏移并跳转, 跳转指令本身不再分发
+#define cmp_jump(c){if((c)==GETARG_A(i))dojump(L,pc,GETARG_sBx(*pc));pc++;}
 #define Protect(x){L->savedpc=pc;{x;};base=L->base;}
-#define arith_op(op, tm){TValue*rb=RKB(i);TValue*rc=RKC(i);if(ttisnumber(rb)&&ttisnumber(rc)){lua_Number nb=nvalue(rb),nc=nvalue(rc);setnvalue(ra,op(nb,nc));}else Protect(Arith(L,ra,rb,rc,tm));}
+#ifdef LUA_USE_JIT
+// 循环回边也计入热度, 只执行一次的主代码块里的热循环同样会被编译, 编译后立即转入本地代码
+#define jit_loop(){if(cl->p->jit==NULL&&++cl->p->hotcount==JIT_HOTCOUNT)luaJ_compile(L,cl->p);if(cl->p->jit!=NULL){L->savedpc=pc;goto reentry;}}
+#else
+#define jit_loop()((void)0)
+#endif
+// 算术指令第一次以数字操作数执行后原地改写为 NN/NK 特化形式, 特化形式的类型检查失败时再改写回通用指令;
+// 常量在编译期就已确定, 所以 NK 形式只需检查寄存器一侧
+#define setopcode(o)SET_OPCODE(*cast(Instruction*,pc-1),o)
+#define quicken(i)if(!ISK(GETARG_B(i)))setopcode(GET_OPCODE(i)-OP_ADD+(ISK(GETARG_C(i))?OP_ADDNK:OP_ADDNN));
+#define arith_op(op, tm){TValue*rb=RKB(i);TValue*rc=RKC(i);if(ttisnumber(rb)&&ttisnumber(rc)){lua_Number nb=nvalue(rb),nc=nvalue(rc);setnvalue(ra,op(nb,nc));quicken(i);}else Protect(Arith(L,ra,rb,rc,tm));}
+#define arith_nn(op, tm){TValue*rb=base+GETARG_B(i);TValue*rc=base+GETARG_C(i);if(ttisnumber(rb)&&ttisnumber(rc)){lua_Number nb=nvalue(rb),nc=nvalue(rc);setnvalue(ra,op(nb,nc));}else{setopcode(tm-TM_ADD+OP_ADD);Protect(Arith(L,ra,rb,rc,tm));}}
+#define arith_nk(op, tm){TValue*rb=base+GETARG_B(i);TValue*rc=k+INDEXK(GETARG_C(i));if(ttisnumber(rb)){lua_Number nb=nvalue(rb),nc=nvalue(rc);setnvalue(ra,op(nb,nc));}else{setopcode(tm-TM_ADD+OP_ADD);Protect(Arith(L,ra,rb,rc,tm));}}
+
+// 下面的指令体由 luaV_execute 和 JIT 的 jit_* 辅助函数共用, 两边只是换个出口:
+// done 是快速路径做完后的出口 (解释器 vmbreak, 辅助函数 return JIT_CONTINUE), then 是条件成立时的跳转.
+// 辅助函数在 jit_frame 里声明了同名的 base/k/ra/cl, pc 指向下一条指令, 所以 Protect 在两边含义相同
+#define op_getglobal(){TValue*rb=KBx(i);const TValue*v=luaH_getstrcached(cl->env,rawtsvalue(rb),&cl->p->cache[pc-cl->p->code-1]);\
+if(v!=NULL&&!ttisnil(v)){setobj(L,ra,v);}else{TValue g;sethvalue(L,&g,cl->env);Protect(luaV_gettable(L,&g,rb,ra));}}
+#define op_setglobal(){Table*h=cl->env;TValue*v=luaH_getstrcached(h,rawtsvalue(KBx(i)),&cl->p->cache[pc-cl->p->code-1]);\
+if(v!=NULL&&!ttisnil(v)){setobj(L,v,ra);h->flags=0;luaC_barriert(L,h,ra);}else{TValue g;sethvalue(L,&g,h);Protect(luaV_settable(L,&g,KBx(i),ra));}}
+// GETFIELD 和 SELF 的快速路径: 表里有值, 或者没有 __index 时直接取 (可能是 nil)
+#define getfield_fast(rb, rc, done){if(ttistable(rb)){Table*h=hvalue(rb);const TValue*v=luaH_getstrcached(h,rawtsvalue(rc),&cl->p->cache[pc-cl->p->code-1]);\
+if(v==NULL){v=(&luaO_nilObject_);}if(!ttisnil(v)||fasttm(L,h->metatable,TM_INDEX)==NULL){setobj(L,ra,v);done;}}}
+#define op_getfield(done){TValue*rb=RB(i);TValue*rc=k+INDEXK(GETARG_C(i));getfield_fast(rb,rc,done);Protect(luaV_gettable(L,rb,rc,ra));}
+#define op_self(done){StkId rb=RB(i);TValue*rc=RKC(i);setobj(L,ra+1,rb);if(ttisstring(rc))getfield_fast(rb,rc,done);Protect(luaV_gettable(L,ra+1,rc,ra));}
+#define op_settable(done){TValue*rb=RKB(i);if(ttistable(ra)&&ttisstring(rb)){Table*h=hvalue(ra);TValue*v=luaH_getstrcached(h,rawtsvalue(rb),&cl->p->cache[pc-cl->p->code-1]);\
+if((v!=NULL&&!ttisnil(v))||fasttm(L,h->metatable,TM_NEWINDEX)==NULL){if(v==NULL)Protect(v=newkey(L,h,rb));setobj(L,v,RKC(i));h->flags=0;luaC_barriert(L,h,RKC(i));done;}}\
+Protect(luaV_settable(L,ra,rb,RKC(i)));}
+#define op_setupval(){UpVal*uv=cl->upvals[GETARG_B(i)];setobj(L,uv->v,ra);luaC_barrier(L,uv,ra);}
+#define op_newtable(){sethvalue(L,ra,luaH_new(L,luaO_fb2int(GETARG_B(i)),luaO_fb2int(GETARG_C(i))));Protect(luaC_checkGC(L));}
+#define op_unm(){TValue*rb=RB(i);if(ttisnumber(rb)){lua_Number nb=nvalue(rb);setnvalue(ra,luai_numunm(nb));}else{Protect(Arith(L,ra,rb,rb,TM_UNM));}}
+#define op_len(){const TValue*rb=RB(i);if(ttistable(rb)){setnvalue(ra,cast_num(luaH_getn(hvalue(rb))));}else if(ttisstring(rb)){setnvalue(ra,cast_num(tsvalue(rb)->len));}\
+else Protect(if(!call_binTM(L,rb,(&luaO_nilObject_),ra,TM_LEN))luaG_typeerror(L,rb,"get length of"));}
+#define op_concat(){int b=GETARG_B(i);int c=GETARG_C(i);Protect(luaV_concat(L,c-b+1,c);luaC_checkGC(L));setobj(L,RA(i),base+b);}
+#define op_forcheck(){const TValue*init=ra;const TValue*plimit=ra+1;const TValue*pstep=ra+2;L->savedpc=pc;\
+if(!tonumber(init,ra))luaG_runerror(L,LUA_QL("for")" initial value must be a number");\
+else if(!tonumber(plimit,ra+1))luaG_runerror(L,LUA_QL("for")" limit must be a number");\
+else if(!tonumber(pstep,ra+2))luaG_runerror(L,LUA_QL("for")" step must be a number");}
+#define forloop_int(then){lua_Integer n=loopint(ra+1);if(n>0){lua_Integer idx=loopint(ra)+loopint(ra+2);setloopint(ra,idx);setloopint(ra+1,n-1);setnvalue(ra+3,cast_num(idx));then;}}
+#define op_tforloop(then){StkId cb=ra+3;setobj(L,cb+2,ra+2);setobj(L,cb+1,ra+1);setobj(L,cb,ra);L->top=cb+3;Protect(luaD_call(L,cb,GETARG_C(i)));\
+L->top=L->ci->top;cb=RA(i)+3;if(!ttisnil(cb)){setobj(L,cb-1,cb);then;}}
+#define op_setlist(done){int n=GETARG_B(i);int c=GETARG_C(i);int last;Table*h;if(n==0){n=cast_int(L->top-ra)-1;L->top=L->ci->top;}\
+if(c==0){c=cast_int(*pc++);}if(!ttistable(ra))done;h=hvalue(ra);last=((c-1)*50)+n;if(last>h->sizearray)luaH_resizearray(L,h,last);\
+for(;n>0;n--){TValue*val=ra+n;setobj(L,luaH_setnum(L,h,last--),val);luaC_barriert(L,h,val);}}
+#define op_closure(){Proto*p=cl->p->p[GETARG_Bx(i)];int nup=p->nups,j;Closure*ncl=luaF_newLclosure(L,nup,cl->env);ncl->l.p=p;\
+for(j=0;j<nup;j++,pc++){if(GET_OPCODE(*pc)==OP_GETUPVAL)ncl->l.upvals[j]=cl->upvals[GETARG_B(*pc)];else ncl->l.upvals[j]=luaF_findupval(L,base+GETARG_B(*pc));}\
+setclvalue(L,ra,ncl);Protect(luaC_checkGC(L));}
+#define op_vararg(){int b=GETARG_B(i)-1;int j;CallInfo*ci=L->ci;int n=cast_int(ci->base-ci->func)-cl->p->numparams-1;\
+if(b==(-1)){Protect(luaD_checkstack(L,n));ra=RA(i);b=n;L->top=ra+n;}for(j=0;j<b;j++){if(j<n){setobj(L,ra+j,ci->base-n+j);}else{setnilvalue(ra+j);}}}
+// 尾调用的目标是 Lua 函数时, 把新帧挪到当前帧的位置
+#define tailcall_frame(){CallInfo*ci=L->ci-1;int aux;StkId func=ci->func;StkId pfunc=(ci+1)->func;if(L->openupval)luaF_close(L,ci->base);\
+L->base=ci->base=ci->func+((ci+1)->base-pfunc);for(aux=0;pfunc+aux<L->top;aux++)setobj(L,func+aux,pfunc+aux);\
+ci->top=L->top=func+aux;ci->savedpc=L->savedpc;ci->tailcalls++;L->ci--;}
+
+// 初值/上限/步长都是整数且绝对值小于 LOOPINT_MAX 时把循环切换成整数模式:
+// (for index) 存放整数下标, (for limit) 存放剩余迭代次数, (for step) 存放整数步长,
+// OP_FORLOOP 只需递减计数并做一次整数加法, 可见的循环变量才转换成 lua_Number
+static int forprepint(StkId ra) {
+    lua_Number init = nvalue(ra);
+    lua_Number limit = nvalue(ra + 1);
+    lua_Number step = nvalue(ra + 2);
+    lua_Integer i, l, s, n;
+    if (sizeof(lua_Integer) < 8 || step == 0 ||
+        !(fabs(init) < LOOPINT_MAX && fabs(limit) < LOOPINT_MAX && fabs(step) < LOOPINT_MAX))
+        return 0;
+    i = cast(lua_Integer, init);
+    l = cast(lua_Integer, limit);
+    s = cast(lua_Integer, step);
+    if (cast_num(i) != init || cast_num(l) != limit || cast_num(s) != step)
+        return 0;
+    if (s > 0)
+        n = i <= l ? (l - i) / s + 1 : 0;
+    else
+        n = i >= l ? (i - l) / -s + 1 : 0;
+    setloopint(ra, i - s);
+    setloopint(ra + 1, n);
+    setloopint(ra + 2, s);
+    return 1;
+}
 
 static void luaV_execute(lua_State *L, int nexeccalls) {
     LClosure *cl;
     StkId base;
     TValue *k;
     const Instruction *pc;
+#ifdef LUA_USE_JUMPTABLE
+    static const void *const disptab[NUM_OPCODES] = {
+            &&L_OP_MOVE, &&L_OP_LOADK, &&L_OP_LOADBOOL, &&L_OP_LOADNIL,
+            &&L_OP_GETUPVAL, &&L_OP_GETGLOBAL, &&L_OP_GETTABLE, &&L_OP_SETGLOBAL,
+            &&L_OP_SETUPVAL, &&L_OP_SETTABLE, &&L_OP_NEWTABLE, &&L_OP_SELF,
+            &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV,
+            &&L_OP_MOD, &&L_OP_POW, &&L_OP_UNM, &&L_OP_NOT,
+            &&L_OP_LEN, &&L_OP_CONCAT, &&L_OP_JMP, &&L_OP_EQ,
+            &&L_OP_LT, &&L_OP_LE, &&L_OP_TEST, &&L_OP_TESTSET,
+            &&L_OP_CALL, &&L_OP_TAILCALL, &&L_OP_RETURN, &&L_OP_FORLOOP,
+            &&L_OP_FORPREP, &&L_OP_TFORLOOP, &&L_OP_SETLIST, &&L_OP_CLOSE,
+            &&L_OP_CLOSURE, &&L_OP_VARARG, &&L_OP_GETFIELD,
+            &&L_OP_ADDNN, &&L_OP_SUBNN, &&L_OP_MULNN, &&L_OP_DIVNN, &&L_OP_MODNN, &&L_OP_POWNN,
+            &&L_OP_ADDNK, &&L_OP_SUBNK, &&L_OP_MULNK, &&L_OP_DIVNK, &&L_OP_MODNK, &&L_OP_POWNK
+    };
+#endif
     reentry:
     pc = L->savedpc;
     cl = &clvalue(L->ci->func)->l;
+#ifdef LUA_USE_JIT
+    if (cl->p->jit != NULL) {
+        switch (luaJ_run(L, cl, pc)) {
+            case JIT_CALL:
+                nexeccalls++;
+                goto reentry;
+            case JIT_TAILCALL:
+                goto reentry;
+            case JIT_RETURN:
+                if (--nexeccalls == 0)
+                    return;
+                goto reentry;
+            case JIT_RETURNTOP:
+                if (--nexeccalls == 0)
+                    return;
+                L->top = L->ci->top;
+                goto reentry;
+            default:
+                return;
+        }
+    }
+#endif
     base = L->base;
     k = cl->p->k;
     for (;;) {
-        const Instruction i = *pc++;
+        Instruction i = *pc++;
         StkId ra;
         ra = RA(i);
-        switch (GET_OPCODE(i)) {
-            case OP_MOVE: {
+        vmdispatch (GET_OPCODE(i)) {
+            vmcase(OP_MOVE) {
                 setobj(L, ra, RB(i));
-                continue;
+                vmbreak;
             }
-            case OP_LOADK: {
+            vmcase(OP_LOADK) {
                 setobj(L, ra, KBx(i));
-                continue;
+                vmbreak;
             }
-            case OP_LOADBOOL: {
+            vmcase(OP_LOADBOOL) {
                 setbvalue(ra, GETARG_B(i));
                 if (GETARG_C(i))pc++;
-                continue;
+                vmbreak;
             }
-            case OP_LOADNIL: {
+            vmcase(OP_LOADNIL) {
                 TValue *rb = RB(i);
                 do {
                     setnilvalue(rb--);
                 } while (rb >= ra);
-                continue;
+                vmbreak;
             }
-            case OP_GETUPVAL: {
+            vmcase(OP_GETUPVAL) {
                 int b = GETARG_B(i);
                 setobj(L, ra, cl->upvals[b]->v);
-                continue;
+                vmbreak;
             }
-            case OP_GETGLOBAL: {
-                TValue g;
-                TValue *rb = KBx(i);
-                sethvalue(L, &g, cl->env);
-                Protect(luaV_gettable(L, &g, rb, ra));
-                continue;
+            vmcase(OP_GETGLOBAL) {
+                op_getglobal();
+                vmbreak;
             }
-            case OP_GETTABLE: {
+            vmcase(OP_GETTABLE) {
                 Protect(luaV_gettable(L, RB(i), RKC(i), ra));
-                continue;
+                vmbreak;
             }
-            case OP_SETGLOBAL: {
-                TValue g;
-                sethvalue(L, &g, cl->env);
-                Protect(luaV_settable(L, &g, KBx(i), ra));
-                continue;
+            vmcase(OP_GETFIELD) {
+                op_getfield(vmbreak);
+                vmbreak;
             }
-            case OP_SETUPVAL: {
-                UpVal *uv = cl->upvals[GETARG_B(i)];
-                setobj(L, uv->v, ra);
-                luaC_barrier(L, uv, ra);
-                continue;
+            vmcase(OP_SETGLOBAL) {
+                op_setglobal();
+                vmbreak;
             }
-            case OP_SETTABLE: {
-                Protect(luaV_settable(L, ra, RKB(i), RKC(i)));
-                continue;
+            vmcase(OP_SETUPVAL) {
+                op_setupval();
+                vmbreak;
             }
-            case OP_NEWTABLE: {
-                int b = GETARG_B(i);
-                int c = GETARG_C(i);
-                sethvalue(L, ra, luaH_new(L, luaO_fb2int(b), luaO_fb2int(c)));
-                Protect(luaC_checkGC(L));
-                continue;
+            vmcase(OP_SETTABLE) {
+                op_settable(vmbreak);
+                vmbreak;
             }
-            case OP_SELF: {
-                StkId rb = RB(i);
-                setobj(L, ra + 1, rb);
-                Protect(luaV_gettable(L, rb, RKC(i), ra));
-                continue;
+            vmcase(OP_NEWTABLE) {
+                op_newtable();
+                vmbreak;
             }
-            case OP_ADD: {
+            vmcase(OP_SELF) {
+                op_self(vmbreak);
+                vmbreak;
+            }
+            vmcase(OP_ADD) {
                 arith_op(luai_numadd, TM_ADD);
-                continue;
+                vmbreak;
             }
-            case OP_SUB: {
+            vmcase(OP_SUB) {
                 arith_op(luai_numsub, TM_SUB);
-                continue;
+                vmbreak;
             }
-            case OP_MUL: {
+            vmcase(OP_MUL) {
                 arith_op(luai_nummul, TM_MUL);
-                continue;
+                vmbreak;
             }
-            case OP_DIV: {
+            vmcase(OP_DIV) {
                 arith_op(luai_numdiv, TM_DIV);
-                continue;
+                vmbreak;
             }
-            case OP_MOD: {
+            vmcase(OP_MOD) {
                 arith_op(luai_nummod, TM_MOD);
-                continue;
+                vmbreak;
             }
-            case OP_POW: {
+            vmcase(OP_POW) {
                 arith_op(luai_numpow, TM_POW);
-                continue;
+                vmbreak;
             }
-            case OP_UNM: {
-                TValue *rb = RB(i);
-                if (ttisnumber(rb)) {
-                    lua_Number nb = nvalue(rb);
-                    setnvalue(ra, luai_numunm(nb));
-                } else {
-                    Protect(Arith(L, ra, rb, rb, TM_UNM));
-                }
-                continue;
+            vmcase(OP_ADDNN) {
+                arith_nn(luai_numadd, TM_ADD);
+                vmbreak;
+            }
+            vmcase(OP_SUBNN) {
+                arith_nn(luai_numsub, TM_SUB);
+                vmbreak;
+            }
+            vmcase(OP_MULNN) {
+                arith_nn(luai_nummul, TM_MUL);
+                vmbreak;
+            }
+            vmcase(OP_DIVNN) {
+                arith_nn(luai_numdiv, TM_DIV);
+                vmbreak;
+            }
+            vmcase(OP_MODNN) {
+                arith_nn(luai_nummod, TM_MOD);
+                vmbreak;
+            }
+            vmcase(OP_POWNN) {
+                arith_nn(luai_numpow, TM_POW);
+                vmbreak;
+            }
+            vmcase(OP_ADDNK) {
+                arith_nk(luai_numadd, TM_ADD);
+                vmbreak;
+            }
+            vmcase(OP_SUBNK) {
+                arith_nk(luai_numsub, TM_SUB);
+                vmbreak;
+            }
+            vmcase(OP_MULNK) {
+                arith_nk(luai_nummul, TM_MUL);
+                vmbreak;
+            }
+            vmcase(OP_DIVNK) {
+                arith_nk(luai_numdiv, TM_DIV);
+                vmbreak;
+            }
+            vmcase(OP_MODNK) {
+                arith_nk(luai_nummod, TM_MOD);
+                vmbreak;
+            }
+            vmcase(OP_POWNK) {
+                arith_nk(luai_numpow, TM_POW);
+                vmbreak;
             }
-            case OP_NOT: {
+            vmcase(OP_UNM) {
+                op_unm();
+                vmbreak;
+            }
+            vmcase(OP_NOT) {
                 int res = l_isfalse(RB(i));
                 setbvalue(ra, res);
-                continue;
+                vmbreak;
             }
-            case OP_LEN: {
-                const TValue *rb = RB(i);
-                switch (ttype(rb)) {
-                    case 5: {
-                        setnvalue(ra, cast_num(luaH_getn(hvalue(rb))));
-                        break;
-                    }
-                    case 4: {
-                        setnvalue(ra, cast_num(tsvalue(rb)->len));
-                        break;
-                    }
-                    default: {
-                        Protect(
-                                if (!call_binTM(L, rb, (&luaO_nilObject_), ra, TM_LEN))
-                                    luaG_typeerror(L, rb, "get length of");
-                        )
-                    }
-                }
-                continue;
+            vmcase(OP_LEN) {
+                op_len();
+                vmbreak;
             }
-            case OP_CONCAT: {
-                int b = GETARG_B(i);
-                int c = GETARG_C(i);
-                Protect(luaV_concat(L, c - b + 1, c);luaC_checkGC(L));
-                setobj(L, RA(i), base + b);
-                continue;
+            vmcase(OP_CONCAT) {
+                op_concat();
+                vmbreak;
             }
-            case OP_JMP: {
+            vmcase(OP_JMP) {
                 dojump(L, pc, GETARG_sBx(i));
-                continue;
+                if (GETARG_sBx(i) < 0)jit_loop();
+                vmbreak;
             }
-            case OP_EQ: {
+            vmcase(OP_EQ) {
                 TValue *rb = RKB(i);
                 TValue *rc = RKC(i);
-                Protect(
-                        if (equalobj(L, rb, rc) == GETARG_A(i))
-                            dojump(L, pc, GETARG_sBx(*pc));
-                )
-                pc++;
-                continue;
+                if (ttisnumber(rb) && ttisnumber(rc)) {
+                    cmp_jump(luai_numeq(nvalue(rb), nvalue(rc)));
+                } else {
+                    Protect(cmp_jump(equalobj(L, rb, rc)));
+                }
+                vmbreak;
             }
-            case OP_LT: {
-                Protect(
-                        if (luaV_lessthan(L, RKB(i), RKC(i)) == GETARG_A(i))
-                            dojump(L, pc, GETARG_sBx(*pc));
-                )
-                pc++;
-                continue;
+            vmcase(OP_LT) {
+                TValue *rb = RKB(i);
+                TValue *rc = RKC(i);
+                if (ttisnumber(rb) && ttisnumber(rc)) {
+                    cmp_jump(luai_numlt(nvalue(rb), nvalue(rc)));
+                } else {
+                    Protect(cmp_jump(luaV_lessthan(L, rb, rc)));
+                }
+                vmbreak;
             }
-            case OP_LE: {
-                Protect(
-                        if (lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
-                            dojump(L, pc, GETARG_sBx(*pc));
-                )
-                pc++;
-                continue;
+            vmcase(OP_LE) {
+                TValue *rb = RKB(i);
+                TValue *rc = RKC(i);
+                if (ttisnumber(rb) && ttisnumber(rc)) {
+                    cmp_jump(luai_numle(nvalue(rb), nvalue(rc)));
+                } else {
+                    Protect(cmp_jump(lessequal(L, rb, rc)));
+                }
+                vmbreak;
             }
-            case OP_TEST: {
+            vmcase(OP_TEST) {
                 if (l_isfalse(ra) != GETARG_C(i)) dojump(L, pc, GETARG_sBx(*pc));
                 pc++;
-                continue;
+                vmbreak;
             }
-            case OP_TESTSET: {
+            vmcase(OP_TESTSET) {
                 TValue *rb = RB(i);
                 if (l_isfalse(rb) != GETARG_C(i)) {
                     setobj(L, ra, rb);
                     dojump(L, pc, GETARG_sBx(*pc));
                 }
                 pc++;
-                continue;
+                vmbreak;
             }
-            case OP_CALL: {
+            vmcase(OP_CALL) {
                 int b = GETARG_B(i);
                 int nResults = GETARG_C(i) - 1;
                 if (b != 0)L->top = ra + b;
@@ -5596,42 +8488,32 @@ static void luaV_execute(lua_State *L, int nexeccalls) {
                     case 1: {
                         if (nResults >= 0)L->top = L->ci->top;
                         base = L->base;
-                        continue;
+                        vmbreak;
                     }
                     default: {
                         return;
                     }
                 }
             }
-            case OP_TAILCALL: {
+            vmcase(OP_TAILCALL) {
                 int b = GETARG_B(i);
                 if (b != 0)L->top = ra + b;
                 L->savedpc = pc;
                 switch (luaD_precall(L, ra, (-1))) {
                     case 0: {
-                        CallInfo *ci = L->ci - 1;
-                        int aux;
-                        StkId func = ci->func;
-                        StkId pfunc = (ci + 1)->func;
-                        if (L->openupval)luaF_close(L, ci->base);
-                        L->base = ci->base = ci->func + ((ci + 1)->base - pfunc);
-                        for (aux = 0; pfunc + aux < L->top; aux++) setobj(L, func + aux, pfunc + aux);
-                        ci->top = L->top = func + aux;
-                        ci->savedpc = L->savedpc;
-                        ci->tailcalls++;
-                        L->ci--;
+                        tailcall_frame();
                         goto reentry;
                     }
                     case 1: {
                         base = L->base;
-                        continue;
+                        vmbreak;
                     }
                     default: {
                         return;
                     }
                 }
             }
-            case OP_RETURN: {
+            vmcase(OP_RETURN) {
                 int b = GETARG_B(i);
                 if (b != 0)L->top = ra + b - 1;
                 if (L->openupval)luaF_close(L, base);
@@ -5644,7 +8526,11 @@ static void luaV_execute(lua_State *L, int nexeccalls) {
                     goto reentry;
                 }
             }
-            case OP_FORLOOP: {
+            vmcase(OP_FORLOOP) {
+                if (ttisloopint(ra)) {
+                    forloop_int({ dojump(L, pc, GETARG_sBx(i)); jit_loop(); });
+                    vmbreak;
+                }
                 lua_Number step = nvalue(ra + 2);
                 lua_Number idx = luai_numadd(nvalue(ra), step);
                 lua_Number limit = nvalue(ra + 1);
@@ -5653,108 +8539,741 @@ static void luaV_execute(lua_State *L, int nexeccalls) {
                     dojump(L, pc, GETARG_sBx(i));
                     setnvalue(ra, idx);
                     setnvalue(ra + 3, idx);
+                    jit_loop();
                 }
-                continue;
+                vmbreak;
             }
-            case OP_FORPREP: {
-                const TValue *init = ra;
-                const TValue *plimit = ra + 1;
-                const TValue *pstep = ra + 2;
-                L->savedpc = pc;
-                if (!tonumber(init, ra))
-                    luaG_runerror(L, LUA_QL("for")" initial value must be a number");
-                else if (!tonumber(plimit, ra + 1))
-                    luaG_runerror(L, LUA_QL("for")" limit must be a number");
-                else if (!tonumber(pstep, ra + 2))
-                    luaG_runerror(L, LUA_QL("for")" step must be a number");
-                setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
+            vmcase(OP_FORPREP) {
+                op_forcheck();
+                if (!forprepint(ra))
+                    setnvalue(ra, luai_numsub(nvalue(ra), nvalue(ra + 2)));
                 dojump(L, pc, GETARG_sBx(i));
-                continue;
+                vmbreak;
             }
-            case OP_TFORLOOP: {
-                StkId cb = ra + 3;
-                setobj(L, cb + 2, ra + 2);
-                setobj(L, cb + 1, ra + 1);
-                setobj(L, cb, ra);
-                L->top = cb + 3;
-                Protect(luaD_call(L, cb, GETARG_C(i)));
-                L->top = L->ci->top;
-                cb = RA(i) + 3;
-                if (!ttisnil(cb)) {
-                    setobj(L, cb - 1, cb);
-                    dojump(L, pc, GETARG_sBx(*pc));
-                }
+            vmcase(OP_TFORLOOP) {
+                op_tforloop(dojump(L, pc, GETARG_sBx(*pc)));
                 pc++;
-                continue;
+                vmbreak;
             }
-            case OP_SETLIST: {
-                int n = GETARG_B(i);
-                int c = GETARG_C(i);
-                int last;
-                Table *h;
-                if (n == 0) {
-                    n = cast_int(L->top - ra) - 1;
-                    L->top = L->ci->top;
-                }
-                if (c == 0)c = cast_int(*pc++);
-                runtime_check(L, ttistable(ra));
-                h = hvalue(ra);
-                last = ((c - 1) * 50) + n;
-                if (last > h->sizearray)
-                    luaH_resizearray(L, h, last);
-                for (; n > 0; n--) {
-                    TValue *val = ra + n;
-                    setobj(L, luaH_setnum(L, h, last--), val);
-                    luaC_barriert(L, h, val);
-                }
-                continue;
+            vmcase(OP_SETLIST) {
+                op_setlist(vmbreak);
+                vmbreak;
             }
-            case OP_CLOSE: {
+            vmcase(OP_CLOSE) {
                 luaF_close(L, ra);
-                continue;
+                vmbreak;
             }
-            case OP_CLOSURE: {
-                Proto *p;
-                Closure *ncl;
-                int nup, j;
-                p = cl->p->p[GETARG_Bx(i)];
-                nup = p->nups;
-                ncl = luaF_newLclosure(L, nup, cl->env);
-                ncl->l.p = p;
-                for (j = 0; j < nup; j++, pc++) {
-                    if (GET_OPCODE(*pc) == OP_GETUPVAL)
-                        ncl->l.upvals[j] = cl->upvals[GETARG_B(*pc)];
-                    else {
-                        ncl->l.upvals[j] = luaF_findupval(L, base + GETARG_B(*pc));
-                    }
-                }
-                setclvalue(L, ra, ncl);
-                Protect(luaC_checkGC(L));
-                continue;
+            vmcase(OP_CLOSURE) {
+                op_closure();
+                vmbreak;
             }
-            case OP_VARARG: {
-                int b = GETARG_B(i) - 1;
-                int j;
-                CallInfo *ci = L->ci;
-                int n = cast_int(ci->base - ci->func) - cl->p->numparams - 1;
-                if (b == (-1)) {
-                    Protect(luaD_checkstack(L, n));
-                    ra = RA(i);
-                    b = n;
-                    L->top = ra + n;
-                }
-                for (j = 0; j < b; j++) {
-                    if (j < n) {
-                        setobj(L, ra + j, ci->base - n + j);
-                    } else {
-                        setnilvalue(ra + j);
-                    }
-                }
-                continue;
+            vmcase(OP_VARARG) {
+                op_vararg();
+                vmbreak;
+            }
+        }
+    }
+}
+
+#ifdef LUA_USE_JIT
+// 基线 JIT: 函数变热后把字节码逐条翻译成 x86-64 机器码. 简单指令直接展开成内联模板,
+// 其余指令调用下面的 jit_* 辅助函数 (指令体与解释器共用 op_* 宏); 调用/尾调用/返回交还给 luaV_execute 处理,
+// 之后再通过 jitmap 从任意一条指令重新进入本地代码.
+// 本地代码里的寄存器约定: rbx=base, r12=L, r13=k, r14=cl
+#define JIT_RAX 0
+#define JIT_RBX 3
+#define JIT_R12 12
+#define JIT_R13 13
+#define JIT_R14 14
+#define JIT_CC_B 0x2
+#define JIT_CC_AE 0x3
+#define JIT_CC_E 0x4
+#define JIT_CC_NE 0x5
+#define JIT_CC_BE 0x6
+#define JIT_CC_A 0x7
+#define JIT_CC_P 0xA
+#define JIT_MAXINS 256
+#define jit_reg(r)(cast_int(r)*cast_int(sizeof(TValue)))
+#define jit_tt(r)(jit_reg(r)+cast_int(offsetof(TValue,tt)))
+#define jit_frame()StkId base=L->base;LClosure*cl=&clvalue(L->ci->func)->l;TValue*k=cl->p->k;StkId ra=RA(i);L->savedpc=pc;(void)k;(void)ra
+
+typedef int (*luaJ_Func)(lua_State *L, const void *entry, LClosure *cl, TValue *k);
+
+typedef int (*luaJ_Helper)(lua_State *L, Instruction i, const Instruction *pc);
+
+typedef struct JitState {
+    unsigned char *mcode;   // 代码缓冲区
+    size_t n;               // 已写入的字节数
+    unsigned int *map;      // 指令下标 -> 代码偏移
+    int *fix;               // 待回填的跳转, 每项两个 int: rel32 所在偏移, 目标指令下标
+    int nfix;
+    int sizefix;
+    size_t exit;            // 公共出口 (恢复寄存器并返回 eax) 的偏移
+} JitState;
+
+static int jit_getglobal(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_getglobal();
+    return JIT_CONTINUE;
+}
+
+static int jit_setglobal(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_setglobal();
+    return JIT_CONTINUE;
+}
+
+static int jit_gettable(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    luaV_gettable(L, RB(i), RKC(i), ra);
+    return JIT_CONTINUE;
+}
+
+static int jit_getfield(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_getfield(return JIT_CONTINUE);
+    return JIT_CONTINUE;
+}
+
+static int jit_self(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_self(return JIT_CONTINUE);
+    return JIT_CONTINUE;
+}
+
+static int jit_settable(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_settable(return JIT_CONTINUE);
+    return JIT_CONTINUE;
+}
+
+static int jit_setupval(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_setupval();
+    return JIT_CONTINUE;
+}
+
+static int jit_newtable(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_newtable();
+    return JIT_CONTINUE;
+}
+
+// MOD/POW 没有内联模板, 数字操作数也走这里, 所以先试数字快速路径
+static int jit_arith(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    TValue *rb = RKB(i);
+    TValue *rc = RKC(i);
+    OpCode op = genericop(GET_OPCODE(i));
+    if (ttisnumber(rb) && ttisnumber(rc)) {
+        lua_Number nb = nvalue(rb), nc = nvalue(rc);
+        switch (op) {
+            case OP_ADD: setnvalue(ra, luai_numadd(nb, nc)); break;
+            case OP_SUB: setnvalue(ra, luai_numsub(nb, nc)); break;
+            case OP_MUL: setnvalue(ra, luai_nummul(nb, nc)); break;
+            case OP_DIV: setnvalue(ra, luai_numdiv(nb, nc)); break;
+            case OP_MOD: setnvalue(ra, luai_nummod(nb, nc)); break;
+            default: setnvalue(ra, luai_numpow(nb, nc)); break;
+        }
+    } else {
+        Arith(L, ra, rb, rc, cast(TMS, op - OP_ADD + TM_ADD));
+    }
+    return JIT_CONTINUE;
+}
+
+static int jit_unm(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_unm();
+    return JIT_CONTINUE;
+}
+
+static int jit_not(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    int res = l_isfalse(RB(i));
+    setbvalue(ra, res);
+    return JIT_CONTINUE;
+}
+
+static int jit_len(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_len();
+    return JIT_CONTINUE;
+}
+
+static int jit_concat(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_concat();
+    return JIT_CONTINUE;
+}
+
+// 比较/测试类辅助函数返回 1 表示需要跳转
+static int jit_eq(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    TValue *rb = RKB(i);
+    TValue *rc = RKC(i);
+    return equalobj(L, rb, rc) == GETARG_A(i);
+}
+
+static int jit_lt(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    return luaV_lessthan(L, RKB(i), RKC(i)) == GETARG_A(i);
+}
+
+static int jit_le(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    return lessequal(L, RKB(i), RKC(i)) == GETARG_A(i);
+}
+
+static int jit_testset(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    TValue *rb = RB(i);
+    if (l_isfalse(rb) != GETARG_C(i)) {
+        setobj(L, ra, rb);
+        return 1;
+    }
+    return 0;
+}
+
+static int jit_call(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    int b = GETARG_B(i);
+    int nResults = GETARG_C(i) - 1;
+    if (b != 0)L->top = ra + b;
+    switch (luaD_precall(L, ra, nResults)) {
+        case 0:
+            return JIT_CALL;
+        case 1:
+            if (nResults >= 0)L->top = L->ci->top;
+            return JIT_CONTINUE;
+        default:
+            return JIT_YIELD;
+    }
+}
+
+static int jit_tailcall(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    int b = GETARG_B(i);
+    if (b != 0)L->top = ra + b;
+    switch (luaD_precall(L, ra, (-1))) {
+        case 0:
+            tailcall_frame();
+            return JIT_TAILCALL;
+        case 1:
+            return JIT_CONTINUE;
+        default:
+            return JIT_YIELD;
+    }
+}
+
+static int jit_return(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    int b = GETARG_B(i);
+    if (b != 0)L->top = ra + b - 1;
+    if (L->openupval)luaF_close(L, base);
+    return luaD_poscall(L, ra) ? JIT_RETURNTOP : JIT_RETURN;
+}
+
+static int jit_forprep(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_forcheck();
+    setnvalue(ra, luai_numsub(nvalue(ra), nvalue(ra + 2)));
+    return JIT_CONTINUE;
+}
+
+// 解释器以整数模式启动的循环转入本地代码后由这里继续, 返回 1 表示继续循环
+static int jit_forloop(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    forloop_int(return 1);
+    return 0;
+}
+
+static int jit_tforloop(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_tforloop(return 1);
+    return 0;
+}
+
+static int jit_setlist(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_setlist(return JIT_CONTINUE);
+    return JIT_CONTINUE;
+}
+
+static int jit_close(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    luaF_close(L, ra);
+    return JIT_CONTINUE;
+}
+
+static int jit_closure(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_closure();
+    return JIT_CONTINUE;
+}
+
+static int jit_vararg(lua_State *L, Instruction i, const Instruction *pc) {
+    jit_frame();
+    op_vararg();
+    return JIT_CONTINUE;
+}
+
+static void jit_byte(JitState *J, int b) {
+    J->mcode[J->n++] = cast(unsigned char, b);
+}
+
+static void jit_u32(JitState *J, unsigned int v) {
+    memcpy(J->mcode + J->n, &v, 4);
+    J->n += 4;
+}
+
+static void jit_u64(JitState *J, const void *p) {
+    memcpy(J->mcode + J->n, &p, 8);
+    J->n += 8;
+}
+
+static void jit_rex(JitState *J, int w, int reg, int base) {
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if (rex != 0x40) jit_byte(J, rex);
+}
+
+// [base+disp32] 形式的 ModRM (r12 作基址时需要 SIB)
+static void jit_modrm(JitState *J, int reg, int base, int disp) {
+    jit_byte(J, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4) jit_byte(J, 0x24);
+    jit_u32(J, cast(unsigned int, disp));
+}
+
+// mov reg64, [base+disp]
+static void jit_load(JitState *J, int reg, int base, int disp) {
+    jit_rex(J, 1, reg, base);
+    jit_byte(J, 0x8B);
+    jit_modrm(J, reg, base, disp);
+}
+
+// SSE 指令 xmm, [base+disp], pfx 为 0x66/0xF2/0xF3
+static void jit_sse(JitState *J, int pfx, int op, int xmm, int base, int disp) {
+    jit_byte(J, pfx);
+    jit_rex(J, 0, xmm, base);
+    jit_byte(J, 0x0F);
+    jit_byte(J, op);
+    jit_modrm(J, xmm, base, disp);
+}
+
+// cmp dword [base+disp], imm8
+static void jit_cmpi(JitState *J, int base, int disp, int imm) {
+    jit_rex(J, 0, 0, base);
+    jit_byte(J, 0x83);
+    jit_modrm(J, 7, base, disp);
+    jit_byte(J, imm);
+}
+
+// mov dword [base+disp], imm32
+static void jit_movi(JitState *J, int base, int disp, int imm) {
+    jit_rex(J, 0, 0, base);
+    jit_byte(J, 0xC7);
+    jit_modrm(J, 0, base, disp);
+    jit_u32(J, cast(unsigned int, imm));
+}
+
+// 跳到第 target 条指令, 偏移在全部翻译完后回填
+static void jit_jcc(JitState *J, int cc, int target) {
+    if (cc < 0) {
+        jit_byte(J, 0xE9);
+    } else {
+        jit_byte(J, 0x0F);
+        jit_byte(J, 0x80 | cc);
+    }
+    J->fix[J->nfix++] = cast_int(J->n);
+    J->fix[J->nfix++] = target;
+    jit_u32(J, 0);
+}
+
+// 模板内部的前向跳转, 返回 rel32 的位置供 jit_here 回填
+static size_t jit_jlocal(JitState *J, int cc) {
+    if (cc < 0) {
+        jit_byte(J, 0xE9);
+    } else {
+        jit_byte(J, 0x0F);
+        jit_byte(J, 0x80 | cc);
+    }
+    jit_u32(J, 0);
+    return J->n - 4;
+}
+
+static void jit_here(JitState *J, size_t pos) {
+    unsigned int rel = cast(unsigned int, J->n - (pos + 4));
+    memcpy(J->mcode + pos, &rel, 4);
+}
+
+static void jit_exit(JitState *J, int cc) {
+    unsigned int rel;
+    if (cc < 0) {
+        jit_byte(J, 0xE9);
+    } else {
+        jit_byte(J, 0x0F);
+        jit_byte(J, 0x80 | cc);
+    }
+    rel = cast(unsigned int, cast(ptrdiff_t, J->exit) - cast(ptrdiff_t, J->n + 4));
+    jit_u32(J, rel);
+}
+
+// 调用辅助函数 fn(L, i, pc) 后重新装载 base, 返回值留在 eax
+static void jit_helper(JitState *J, luaJ_Helper fn, Instruction i, const Instruction *pc) {
+    jit_byte(J, 0x4C); jit_byte(J, 0x89); jit_byte(J, 0xE7);    // mov rdi, r12
+    jit_byte(J, 0xBE); jit_u32(J, i);                           // mov esi, i
+    jit_byte(J, 0x48); jit_byte(J, 0xBA); jit_u64(J, pc);       // mov rdx, pc
+    jit_byte(J, 0x48); jit_byte(J, 0xB8); jit_u64(J, cast(void*, fn));   // mov rax, fn
+    jit_byte(J, 0xFF); jit_byte(J, 0xD0);                       // call rax
+    jit_load(J, JIT_RBX, JIT_R12, offsetof(lua_State, base));
+    jit_byte(J, 0x85); jit_byte(J, 0xC0);                       // test eax, eax
+}
+
+// 把 RK 操作数的地址 (基址寄存器+偏移) 算出来; 操作数不是数字常量时返回 0
+static int jit_rkaddr(Proto *p, int rk, int *base, int *disp, int *isk) {
+    *isk = ISK(rk) != 0;
+    if (*isk) {
+        *base = JIT_R13;
+        *disp = jit_reg(INDEXK(rk));
+        return ttisnumber(&p->k[INDEXK(rk)]);
+    }
+    *base = JIT_RBX;
+    *disp = jit_reg(rk);
+    return 1;
+}
+
+// 两个数字操作数的快速路径: 类型检查失败的跳转记在 slow[] 里, 成功时 xmm0=B, 返回跳转个数; 不可能走快速路径时返回 -1
+static int jit_numoperands(JitState *J, Proto *p, Instruction i, size_t *slow) {
+    int bb, bd, bk, cb, cd, ck, n = 0;
+    if (!jit_rkaddr(p, GETARG_B(i), &bb, &bd, &bk) || !jit_rkaddr(p, GETARG_C(i), &cb, &cd, &ck))
+        return -1;
+    if (!bk) {
+        jit_cmpi(J, bb, bd + cast_int(offsetof(TValue, tt)), 3);
+        slow[n++] = jit_jlocal(J, JIT_CC_NE);
+    }
+    if (!ck) {
+        jit_cmpi(J, cb, cd + cast_int(offsetof(TValue, tt)), 3);
+        slow[n++] = jit_jlocal(J, JIT_CC_NE);
+    }
+    jit_sse(J, 0xF2, 0x10, 0, bb, bd);     // movsd xmm0, B
+    jit_sse(J, 0xF2, 0x10, 1, cb, cd);     // movsd xmm1, C
+    return n;
+}
+
+static void jit_arithop(JitState *J, Proto *p, Instruction i, const Instruction *pc, int sseop) {
+    size_t slow[2], done;
+    int n = sseop ? jit_numoperands(J, p, i, slow) : -1;
+    int a = GETARG_A(i);
+    if (n < 0) {
+        jit_helper(J, jit_arith, i, pc);
+        return;
+    }
+    jit_byte(J, 0xF2); jit_byte(J, 0x0F); jit_byte(J, sseop); jit_byte(J, 0xC1);     // op xmm0, xmm1
+    jit_sse(J, 0xF2, 0x11, 0, JIT_RBX, jit_reg(a));     // movsd [A], xmm0
+    jit_movi(J, JIT_RBX, jit_tt(a), 3);
+    done = jit_jlocal(J, -1);
+    while (n--) jit_here(J, slow[n]);
+    jit_helper(J, jit_arith, i, pc);
+    jit_here(J, done);
+}
+
+// 比较后跟一条 OP_JMP: 条件结果等于 A 时跳到 JMP 的目标, 否则跳过 JMP
+static void jit_compare(JitState *J, Proto *p, int pcidx, luaJ_Helper helper) {
+    Instruction i = p->code[pcidx];
+    const Instruction *pc = p->code + pcidx + 1;
+    OpCode op = GET_OPCODE(i);
+    int target = pcidx + 2 + GETARG_sBx(p->code[pcidx + 1]);
+    int next = pcidx + 2;
+    int a = GETARG_A(i);
+    size_t slow[2];
+    int n = jit_numoperands(J, p, i, slow);
+    if (n >= 0) {
+        if (op == OP_EQ) {
+            jit_byte(J, 0x66); jit_byte(J, 0x0F); jit_byte(J, 0x2E); jit_byte(J, 0xC1);  // ucomisd xmm0, xmm1
+            if (a) {
+                jit_jcc(J, JIT_CC_P, next);
+                jit_jcc(J, JIT_CC_E, target);
+            } else {
+                jit_jcc(J, JIT_CC_P, target);
+                jit_jcc(J, JIT_CC_NE, target);
             }
+        } else {
+            jit_byte(J, 0x66); jit_byte(J, 0x0F); jit_byte(J, 0x2E); jit_byte(J, 0xC8);  // ucomisd xmm1, xmm0
+            if (op == OP_LT) jit_jcc(J, a ? JIT_CC_A : JIT_CC_BE, target);
+            else jit_jcc(J, a ? JIT_CC_AE : JIT_CC_B, target);
+        }
+        jit_jcc(J, -1, next);
+        while (n--) jit_here(J, slow[n]);
+    }
+    jit_helper(J, helper, i, pc);
+    jit_jcc(J, JIT_CC_NE, target);
+    jit_jcc(J, -1, next);
+}
+
+static void jit_instruction(JitState *J, Proto *p, int pcidx) {
+    Instruction i = p->code[pcidx];
+    const Instruction *pc = p->code + pcidx + 1;
+    int a = GETARG_A(i);
+    switch (genericop(GET_OPCODE(i))) {
+        case OP_MOVE:
+            jit_sse(J, 0xF3, 0x6F, 0, JIT_RBX, jit_reg(GETARG_B(i)));
+            jit_sse(J, 0xF3, 0x7F, 0, JIT_RBX, jit_reg(a));
+            break;
+        case OP_LOADK:
+            jit_sse(J, 0xF3, 0x6F, 0, JIT_R13, jit_reg(GETARG_Bx(i)));
+            jit_sse(J, 0xF3, 0x7F, 0, JIT_RBX, jit_reg(a));
+            break;
+        case OP_LOADBOOL:
+            jit_movi(J, JIT_RBX, jit_reg(a), GETARG_B(i));
+            jit_movi(J, JIT_RBX, jit_tt(a), 1);
+            if (GETARG_C(i)) jit_jcc(J, -1, pcidx + 2);
+            break;
+        case OP_LOADNIL: {
+            int r;
+            for (r = a; r <= GETARG_B(i); r++) jit_movi(J, JIT_RBX, jit_tt(r), 0);
+            break;
+        }
+        case OP_GETUPVAL:
+            jit_load(J, JIT_RAX, JIT_R14, cast_int(offsetof(LClosure, upvals)) + GETARG_B(i) * cast_int(sizeof(UpVal *)));
+            jit_load(J, JIT_RAX, JIT_RAX, offsetof(UpVal, v));
+            jit_sse(J, 0xF3, 0x6F, 0, JIT_RAX, 0);
+            jit_sse(J, 0xF3, 0x7F, 0, JIT_RBX, jit_reg(a));
+            break;
+        case OP_GETGLOBAL:
+            jit_helper(J, jit_getglobal, i, pc);
+            break;
+        case OP_GETTABLE:
+            jit_helper(J, jit_gettable, i, pc);
+            break;
+        case OP_GETFIELD:
+            jit_helper(J, jit_getfield, i, pc);
+            break;
+        case OP_SETGLOBAL:
+            jit_helper(J, jit_setglobal, i, pc);
+            break;
+        case OP_SETUPVAL:
+            jit_helper(J, jit_setupval, i, pc);
+            break;
+        case OP_SETTABLE:
+            jit_helper(J, jit_settable, i, pc);
+            break;
+        case OP_NEWTABLE:
+            jit_helper(J, jit_newtable, i, pc);
+            break;
+        case OP_SELF:
+            jit_helper(J, jit_self, i, pc);
+            break;
+        case OP_ADD:
+            jit_arithop(J, p, i, pc, 0x58);
+            break;
+        case OP_SUB:
+            jit_arithop(J, p, i, pc, 0x5C);
+            break;
+        case OP_MUL:
+            jit_arithop(J, p, i, pc, 0x59);
+            break;
+        case OP_DIV:
+            jit_arithop(J, p, i, pc, 0x5E);
+            break;
+        case OP_MOD:
+        case OP_POW:
+            jit_arithop(J, p, i, pc, 0);
+            break;
+        case OP_UNM:
+            jit_helper(J, jit_unm, i, pc);
+            break;
+        case OP_NOT:
+            jit_helper(J, jit_not, i, pc);
+            break;
+        case OP_LEN:
+            jit_helper(J, jit_len, i, pc);
+            break;
+        case OP_CONCAT:
+            jit_helper(J, jit_concat, i, pc);
+            break;
+        case OP_JMP:
+            jit_jcc(J, -1, pcidx + 1 + GETARG_sBx(i));
+            break;
+        case OP_EQ:
+            jit_compare(J, p, pcidx, jit_eq);
+            break;
+        case OP_LT:
+            jit_compare(J, p, pcidx, jit_lt);
+            break;
+        case OP_LE:
+            jit_compare(J, p, pcidx, jit_le);
+            break;
+        case OP_TEST: {
+            int target = pcidx + 2 + GETARG_sBx(p->code[pcidx + 1]);
+            int truthy = GETARG_C(i) ? target : pcidx + 2;
+            int falsy = GETARG_C(i) ? pcidx + 2 : target;
+            jit_rex(J, 0, 0, JIT_RBX);
+            jit_byte(J, 0x8B);
+            jit_modrm(J, JIT_RAX, JIT_RBX, jit_tt(a));      // mov eax, [A].tt
+            jit_byte(J, 0x83); jit_byte(J, 0xF8); jit_byte(J, 1);   // cmp eax, 1
+            jit_jcc(J, JIT_CC_A, truthy);
+            jit_jcc(J, JIT_CC_B, falsy);
+            jit_cmpi(J, JIT_RBX, jit_reg(a), 0);
+            jit_jcc(J, JIT_CC_E, falsy);
+            jit_jcc(J, -1, truthy);
+            break;
+        }
+        case OP_TESTSET:
+            jit_helper(J, jit_testset, i, pc);
+            jit_jcc(J, JIT_CC_NE, pcidx + 2 + GETARG_sBx(p->code[pcidx + 1]));
+            jit_jcc(J, -1, pcidx + 2);
+            break;
+        case OP_CALL:
+            jit_helper(J, jit_call, i, pc);
+            jit_exit(J, JIT_CC_NE);
+            break;
+        case OP_TAILCALL:
+            jit_helper(J, jit_tailcall, i, pc);
+            jit_exit(J, JIT_CC_NE);
+            break;
+        case OP_RETURN:
+            jit_helper(J, jit_return, i, pc);
+            jit_exit(J, -1);
+            break;
+        case OP_FORLOOP: {
+            size_t neg, exit1, exit2, isint, done;
+            jit_cmpi(J, JIT_RBX, jit_tt(a), 3);
+            isint = jit_jlocal(J, JIT_CC_NE);
+            jit_sse(J, 0xF2, 0x10, 0, JIT_RBX, jit_reg(a));         // movsd xmm0, idx
+            jit_sse(J, 0xF2, 0x58, 0, JIT_RBX, jit_reg(a + 2));     // addsd xmm0, step
+            jit_sse(J, 0xF2, 0x10, 1, JIT_RBX, jit_reg(a + 1));     // movsd xmm1, limit
+            jit_sse(J, 0xF2, 0x10, 3, JIT_RBX, jit_reg(a + 2));     // movsd xmm3, step
+            jit_byte(J, 0x66); jit_byte(J, 0x0F); jit_byte(J, 0x57); jit_byte(J, 0xD2);  // xorpd xmm2, xmm2
+            jit_byte(J, 0x66); jit_byte(J, 0x0F); jit_byte(J, 0x2E); jit_byte(J, 0xDA);  // ucomisd xmm3, xmm2
+            neg = jit_jlocal(J, JIT_CC_BE);
+            jit_byte(J, 0x66); jit_byte(J, 0x0F); jit_byte(J, 0x2E); jit_byte(J, 0xC8);  // ucomisd xmm1, xmm0
+            exit1 = jit_jlocal(J, JIT_CC_B);
+            jit_sse(J, 0xF2, 0x11, 0, JIT_RBX, jit_reg(a));
+            jit_sse(J, 0xF2, 0x11, 0, JIT_RBX, jit_reg(a + 3));
+            jit_movi(J, JIT_RBX, jit_tt(a + 3), 3);
+            jit_jcc(J, -1, pcidx + 1 + GETARG_sBx(i));
+            jit_here(J, neg);
+            jit_byte(J, 0x66); jit_byte(J, 0x0F); jit_byte(J, 0x2E); jit_byte(J, 0xC1);  // ucomisd xmm0, xmm1
+            exit2 = jit_jlocal(J, JIT_CC_B);
+            jit_sse(J, 0xF2, 0x11, 0, JIT_RBX, jit_reg(a));
+            jit_sse(J, 0xF2, 0x11, 0, JIT_RBX, jit_reg(a + 3));
+            jit_movi(J, JIT_RBX, jit_tt(a + 3), 3);
+            jit_jcc(J, -1, pcidx + 1 + GETARG_sBx(i));
+            jit_here(J, exit1);
+            jit_here(J, exit2);
+            done = jit_jlocal(J, -1);
+            jit_here(J, isint);
+            jit_helper(J, jit_forloop, i, pc);
+            jit_jcc(J, JIT_CC_NE, pcidx + 1 + GETARG_sBx(i));
+            jit_here(J, done);
+            break;
         }
+        case OP_FORPREP:
+            jit_helper(J, jit_forprep, i, pc);
+            jit_jcc(J, -1, pcidx + 1 + GETARG_sBx(i));
+            break;
+        case OP_TFORLOOP:
+            jit_helper(J, jit_tforloop, i, pc);
+            jit_jcc(J, JIT_CC_NE, pcidx + 2 + GETARG_sBx(p->code[pcidx + 1]));
+            jit_jcc(J, -1, pcidx + 2);
+            break;
+        case OP_SETLIST:
+            jit_helper(J, jit_setlist, i, pc);
+            break;
+        case OP_CLOSE:
+            jit_helper(J, jit_close, i, pc);
+            break;
+        case OP_CLOSURE:
+            jit_helper(J, jit_closure, i, pc);
+            break;
+        case OP_VARARG:
+            jit_helper(J, jit_vararg, i, pc);
+            break;
+        default:
+            break;
+    }
+}
+
+static void luaJ_compile(lua_State *L, Proto *p) {
+    static const unsigned char prologue[] = {
+            0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,  // push rbp, rbx, r12-r15
+            0x48, 0x83, 0xEC, 0x08,                                     // sub rsp, 8
+            0x49, 0x89, 0xFC,                                           // mov r12, rdi
+            0x49, 0x89, 0xD6,                                           // mov r14, rdx
+            0x49, 0x89, 0xCD                                            // mov r13, rcx
+    };
+    static const unsigned char epilogue[] = {
+            0x48, 0x83, 0xC4, 0x08,                                     // add rsp, 8
+            0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0x5D,  // pop r15-r12, rbx, rbp
+            0xC3                                                        // ret
+    };
+    JitState J;
+    size_t size = 64;
+    int pcidx, f;
+    void *mem;
+    for (pcidx = 0; pcidx < p->sizecode; pcidx++) {    // LOADNIL 的模板长度与寄存器个数成正比
+        Instruction i = p->code[pcidx];
+        size += JIT_MAXINS;
+        if (GET_OPCODE(i) == OP_LOADNIL) size += cast(size_t, GETARG_B(i) - GETARG_A(i) + 1) * 16;
+    }
+    J.nfix = 0;
+    J.sizefix = p->sizecode * 10;
+    J.fix = luaM_newvector(L, J.sizefix, int);
+    J.map = luaM_newvector(L, p->sizecode, unsigned int);
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        luaM_freearray(L, J.fix, J.sizefix, int);
+        luaM_freearray(L, J.map, p->sizecode, unsigned int);
+        return;
+    }
+    J.mcode = cast(unsigned char *, mem);
+    memcpy(J.mcode, prologue, sizeof(prologue));
+    J.n = sizeof(prologue);
+    jit_load(&J, JIT_RBX, JIT_R12, offsetof(lua_State, base));
+    jit_byte(&J, 0xFF); jit_byte(&J, 0xE6);     // jmp rsi
+    J.exit = J.n;
+    memcpy(J.mcode + J.n, epilogue, sizeof(epilogue));
+    J.n += sizeof(epilogue);
+    for (pcidx = 0; pcidx < p->sizecode; pcidx++) {
+        Instruction i = p->code[pcidx];
+        OpCode op = GET_OPCODE(i);
+        J.map[pcidx] = cast(unsigned int, J.n);
+        jit_instruction(&J, p, pcidx);
+        if (op == OP_CLOSURE) {     // 跳过紧随其后的上值描述
+            int j, nup = p->p[GETARG_Bx(i)]->nups;
+            for (j = 0; j < nup; j++) J.map[++pcidx] = cast(unsigned int, J.n);
+        } else if (op == OP_SETLIST && GETARG_C(i) == 0) {
+            J.map[++pcidx] = cast(unsigned int, J.n);
+        }
+    }
+    for (f = 0; f < J.nfix; f += 2) {
+        size_t pos = cast(size_t, J.fix[f]);
+        unsigned int rel = J.map[J.fix[f + 1]] - cast(unsigned int, pos + 4);
+        memcpy(J.mcode + pos, &rel, 4);
+    }
+    luaM_freearray(L, J.fix, J.sizefix, int);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        luaM_freearray(L, J.map, p->sizecode, unsigned int);
+        return;
     }
+    p->jit = mem;
+    p->sizejit = size;
+    p->jitmap = J.map;
+}
+
+static void luaJ_free(lua_State *L, Proto *p) {
+    if (p->jit == NULL) return;
+    munmap(p->jit, p->sizejit);
+    luaM_freearray(L, p->jitmap, p->sizecode, unsigned int);
+    p->jit = NULL;
+}
+
+static int luaJ_run(lua_State *L, LClosure *cl, const Instruction *pc) {
+    Proto *p = cl->p;
+    luaJ_Func f = cast(luaJ_Func, p->jit);
+    return f(L, cast(char *, p->jit) + p->jitmap[pc - p->code], cl, p->k);
 }
+#endif
 
 #define api_checknelems(L, n)luai_apicheck(L,(n)<=(L->top-L->base))
 #define api_checkvalidindex(L, i)luai_apicheck(L,(i)!=(&luaO_nilObject_))
@@ -6100,6 +9619,12 @@ void lua_createTable(lua_State *L, int nArray, int nRec) {
     api_incr_top(L);
 }
 
+void lua_cleartable(lua_State *L, int idx) {
+    StkId t = index2adr(L, idx);
+    luai_apicheck(L, ttistable(t));
+    luaH_clear(hvalue(t));
+}
+
 int lua_getmetatable(lua_State *L, int objIndex) {
     const TValue *obj;
     Table *mt = NULL;
@@ -6292,6 +9817,253 @@ int lua_load(lua_State *L, lua_Reader reader, void *data, const char *chunkName)
     return status;
 }
 
+static const char *getimage(lua_State *L, void *ud, size_t *size) {
+    Image *im = cast(Image *, ud);
+    (void) L;
+    if (im->size == 0) return NULL;
+    *size = im->size;
+    im->size = 0;
+    return cast(const char *, im->p);
+}
+
+// 从常驻内存 [p, p+size) 加载代码块, 之后 p 归状态机所有: 若加载出的 Proto 直接引用了映像,
+// 映像保留到 lua_close 时再用 release 释放, 否则立即释放
+int lua_loadimage(lua_State *L, void *p, size_t size, lua_Release release, const char *chunkName) {
+    ZIO z;
+    Image im;
+    int status;
+    if (!chunkName)chunkName = "?";
+    im.p = p;
+    im.size = size;
+    luaZ_init(L, &z, getimage, &im);
+    z.mapped = (cast(size_t, p) % sizeof(lua_Number) == 0);
+    status = luaD_protectedparser(L, &z, chunkName);
+    if (status == 0 && z.mapped && size > LUAC_HEADERSIZE &&
+        memcmp(p, LUA_SIGNATURE, sizeof(LUA_SIGNATURE) - 1) == 0 && cast(char *, p)[5] == LUAC_IMAGE) {
+        Image *i = luaM_new(L, Image);
+        i->p = p;
+        i->size = size;
+        i->release = release;
+        i->next = G(L)->images;
+        G(L)->images = i;
+    } else {
+        (*release)(p, size);
+    }
+    return status;
+}
+
+int lua_dump(lua_State *L, lua_Writer writer, void *data) {
+    int status;
+    TValue *o;
+    api_checknelems(L, 1);
+    o = L->top - 1;
+    if (ttisfunction(o) && !clvalue(o)->c.isC)
+        status = luaU_dump(L, clvalue(o)->l.p, writer, data, 0);
+    else
+        status = 1;
+    return status;
+}
+
+int lua_dumpimage(lua_State *L, lua_Writer writer, void *data) {
+    int status;
+    TValue *o;
+    api_checknelems(L, 1);
+    o = L->top - 1;
+    if (ttisfunction(o) && !clvalue(o)->c.isC)
+        status = luaU_dump(L, clvalue(o)->l.p, writer, data, 1);
+    else
+        status = 1;
+    return status;
+}
+
+static void snap_init(SnapState *ss) {
+    ss->map.key = NULL;
+    ss->map.val = NULL;
+    ss->map.size = 0;
+    ss->map.n = 0;
+    ss->strs = ss->map;
+    ss->str = NULL;
+    ss->sizestr = 0;
+    ss->nstr = 0;
+    ss->obj = NULL;
+    ss->sizeobj = 0;
+    ss->nobj = 0;
+    ss->names = NULL;
+    ss->sizenames = 0;
+    ss->nnames = 0;
+    ss->keys = NULL;
+    ss->sizekeys = 0;
+}
+
+int lua_snapshot(lua_State *L, lua_Writer writer, void *data) {
+    SnapState ss;
+    int status;
+    snap_init(&ss);
+    ss.u.D.L = L;
+    ss.u.D.writer = writer;
+    ss.u.D.data = data;
+    ss.u.D.status = 0;
+    ss.u.D.image = 0;
+    ss.u.D.pos = 0;
+    status = luaD_pcall(L, f_snapshot, &ss, savestack(L, L->top), L->errfunc);
+    snap_free(L, &ss);
+    return status;
+}
+
+int lua_restore(lua_State *L, lua_Reader reader, void *data, const char *chunkName) {
+    SnapState ss;
+    ZIO z;
+    MBuffer buff;
+    int status;
+    if (!chunkName)chunkName = "?";
+    snap_init(&ss);
+    luaZ_init(L, &z, reader, data);
+    luaZ_initbuffer(L, &buff);
+    ss.u.S.L = L;
+    ss.u.S.Z = &z;
+    ss.u.S.b = &buff;
+    ss.u.S.name = (*chunkName == '@' || *chunkName == '=') ? chunkName + 1 : chunkName;
+    ss.u.S.image = 0;
+    ss.u.S.mapped = 0;
+    ss.u.S.pos = 0;
+    status = luaD_pcall(L, f_restore, &ss, savestack(L, L->top), L->errfunc);
+    luaZ_freebuffer(L, &buff);
+    snap_free(L, &ss);
+    return status;
+}
+
+int lua_gc(lua_State *L, int what, int data) {
+    int res = 0;
+    global_State *g = G(L);
+    switch (what) {
+        case LUA_GCSTOP:
+            g->gcstopped = 1;
+            setthreshold(g);
+            break;
+        case LUA_GCRESTART:
+            g->gcstopped = 0;
+            g->GCthreshold = g->totalbytes;
+            break;
+        case LUA_GCCOLLECT:
+            luaC_fullgc(L);
+            break;
+        case LUA_GCCOUNT:
+            res = cast_int(g->totalbytes >> 10);
+            break;
+        case LUA_GCCOUNTB:
+            res = cast_int(g->totalbytes & 0x3ff);
+            break;
+        case LUA_GCSTEP: {
+            // 假装又分配了 data KB, 按这个债务推进回收; 一轮结束时返回 1
+            lu_mem a = (cast(lu_mem, data) << 10);
+            if (a <= g->totalbytes)
+                g->GCthreshold = g->totalbytes - a;
+            else
+                g->GCthreshold = 0;
+            while (g->GCthreshold <= g->totalbytes) {
+                luaC_step(L);
+                // 分代模式下每一步都是一次完整的小回收
+                if (g->gcstate == GCS_PAUSE || g->gckind == LUA_GCGEN) {
+                    res = 1;
+                    break;
+                }
+            }
+            break;
+        }
+        case LUA_GCSETPAUSE:
+            res = g->gcpause;
+            g->gcpause = data;
+            break;
+        case LUA_GCSETSTEPMUL:
+            res = g->gcstepmul;
+            g->gcstepmul = data;
+            break;
+        case LUA_GCSETMAJORINC:
+            res = g->gcmajorinc;
+            g->gcmajorinc = data;
+            break;
+        default:
+            res = -1;
+    }
+    return res;
+}
+
+void lua_gcstats(lua_State *L, lua_GCStats *s) {
+    *s = G(L)->gcstats;
+}
+
+int lua_gcmode(lua_State *L, int mode) {
+    global_State *g = G(L);
+    int old = g->gckind;
+    if (mode != old) {
+        g->gckind = cast_byte(mode);
+        luaC_fullgc(L);
+    }
+    return old;
+}
+
+int lua_gcworkers(lua_State *L, int n) {
+#ifdef LUA_USE_PARMARK
+    MarkPool *p = G(L)->markpool;
+    int old = p ? p->n : 1;
+    if (n <= 0)
+        n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > PM_MAXWORKERS)
+        n = PM_MAXWORKERS;
+    if (n != old) {
+        pm_stop(L);
+        if (n > 1)
+            pm_start(L, n);
+    }
+    return old;
+#else
+    (void) L;
+    (void) n;
+    return 1;
+#endif
+}
+
+int lua_gcsweeper(lua_State *L, int on) {
+#ifdef LUA_USE_BGSWEEP
+    int old = (G(L)->sweeper != NULL);
+    if (on && !old)
+        bg_start(L);
+    else if (!on && old)
+        bg_stop(L);
+    return old;
+#else
+    (void) L;
+    (void) on;
+    return 0;
+#endif
+}
+
+int lua_setarena(lua_State *L, size_t size) {
+    global_State *g = G(L);
+    char *p;
+    if (g->arenabase != NULL || size == 0)
+        return 0;
+    size = arenaround(size);
+    p = (char *) (*g->frealloc)(g->userdata, NULL, 0, size);
+    if (p == NULL)
+        return 0;
+    g->arenabase = p;
+    g->arenatop = p;
+    g->arenaend = p + size;
+    // 竞技场用完之前回收也还不回内存, 先停掉; 有内存上限时仍在上限处回收
+    g->GCthreshold = g->memlimit ? g->memlimit : ((lu_mem) (~(lu_mem) 0) - 2);
+    return 1;
+}
+
+size_t lua_setmemlimit(lua_State *L, size_t limit) {
+    global_State *g = G(L);
+    size_t old = g->memlimit;
+    g->memlimit = limit;
+    if (limit != 0 && g->GCthreshold > limit)
+        g->GCthreshold = limit;
+    return old;
+}
+
 int lua_error(lua_State *L) {
     api_checknelems(L, 1);
     luaG_errormsg(L);
@@ -6303,7 +10075,20 @@ int lua_next(lua_State *L, int idx) {
     int more;
     t = index2adr(L, idx);
     luai_apicheck(L, ttistable(t));
-    more = luaH_next(L, hvalue(t), L->top - 1);
+    more = luaH_next(L, hvalue(t), L->top - 1, &L->nextpos);
+    if (more) {
+        api_incr_top(L);
+    } else
+        L->top -= 1;
+    return more;
+}
+
+int lua_nextat(lua_State *L, int idx, int *pos) {
+    StkId t;
+    int more;
+    t = index2adr(L, idx);
+    luai_apicheck(L, ttistable(t));
+    more = luaH_next(L, hvalue(t), L->top - 1, pos);
     if (more) {
         api_incr_top(L);
     } else
@@ -6335,7 +10120,7 @@ void *lua_newUserdata(lua_State *L, size_t size) {
 extern const luaL_Reg bitLib[];
 extern const luaL_Reg luaLibs[];
 
-extern lua_State *luaL_newState();
+extern lua_State *luaL_newState(int alloc);
 
 extern void luaL_register(lua_State *L, const char *libname, const luaL_Reg *l);
 
@@ -6343,13 +10128,143 @@ extern void luaL_openlibs(lua_State *L);
 
 extern int luaL_loadfile(lua_State *L, const char *filename);
 
+static int filewriter(lua_State *L, const void *p, size_t size, void *f) {
+    (void) L;
+    return fwrite(p, 1, size, (FILE *) f) != size;
+}
+
+// minilua_learn -b in.lua out.luac: 只编译不运行, 把字节码映像写到 out.luac
+// 映像会被正在运行的进程整个映射进内存, 所以不能原地改写: 先写到同目录下的临时文件,
+// 写完再 rename 过去, 已经映射了旧文件的进程继续使用旧的 inode
+static int precompile(lua_State *L, const char *in, const char *out) {
+    FILE *f;
+    int status;
+    if (luaL_loadfile(L, in))
+        return 1;
+#ifdef LUA_USE_MKSTEMP
+    {
+        char *name = (char *) malloc(strlen(out) + 8);
+        mode_t m = umask(0);
+        int fd = -1;
+        umask(m);
+        if (name != NULL) {
+            sprintf(name, "%s.XXXXXX", out);
+            fd = mkstemp(name);
+        }
+        if (fd < 0 || fchmod(fd, 0666 & ~m) != 0 || (f = fdopen(fd, "wb")) == NULL) {
+            if (fd >= 0) {
+                close(fd);
+                remove(name);
+            }
+            free(name);
+            lua_pushfstring(L, "cannot open %s", out);
+            return 1;
+        }
+        status = lua_dumpimage(L, filewriter, f);
+        if (fclose(f) != 0 || status != 0 || rename(name, out) != 0) {
+            remove(name);
+            free(name);
+            lua_pushfstring(L, "cannot write %s", out);
+            return 1;
+        }
+        free(name);
+        return 0;
+    }
+#else
+    f = fopen(out, "wb");
+    if (f == NULL) {
+        lua_pushfstring(L, "cannot open %s", out);
+        return 1;
+    }
+    status = lua_dumpimage(L, filewriter, f);
+    if (fclose(f) != 0 || status != 0) {
+        lua_pushfstring(L, "cannot write %s", out);
+        return 1;
+    }
+    return 0;
+#endif
+}
+
+typedef struct FileReader {
+    FILE *f;
+    char buff[BUFSIZ];
+} FileReader;
+
+static const char *filereader(lua_State *L, void *ud, size_t *size) {
+    FileReader *fr = (FileReader *) ud;
+    (void) L;
+    *size = fread(fr->buff, 1, sizeof(fr->buff), fr->f);
+    return *size > 0 ? fr->buff : NULL;
+}
+
+// minilua_learn -s boot.lua out.snap: 运行 boot.lua 后把整个状态机写成快照
+static int snapshot(lua_State *L, const char *in, const char *out) {
+    FILE *f;
+    int status;
+    if (luaL_loadfile(L, in) || lua_pcall(L, 0, 0, 0))
+        return 1;
+    f = fopen(out, "wb");
+    if (f == NULL) {
+        lua_pushfstring(L, "cannot open %s", out);
+        return 1;
+    }
+    status = lua_snapshot(L, filewriter, f);
+    if (fclose(f) != 0 && status == 0) {
+        lua_pushfstring(L, "cannot write %s", out);
+        return 1;
+    }
+    return status;
+}
+
+// minilua_learn -r in.snap script.lua ...: 先从快照恢复状态机, 再照常运行脚本
+static int restore(lua_State *L, const char *in) {
+    FileReader fr;
+    int status;
+    fr.f = fopen(in, "rb");
+    if (fr.f == NULL) {
+        lua_pushfstring(L, "cannot open %s", in);
+        return 1;
+    }
+    lua_pushfstring(L, "@%s", in);
+    status = lua_restore(L, filereader, &fr, lua_tostring(L, -1));
+    lua_remove(L, status ? -2 : -1);
+    fclose(fr.f);
+    return status;
+}
+
 int main(int argc, char *argv[]) {
-    lua_State *L = luaL_newState();
+    lua_State *L = luaL_newState(LUA_ALLOC_SLAB);
     luaL_openlibs(L);
+#ifdef LUA_USE_PARMARK
+    lua_gcworkers(L, 0);
+#endif
+#ifdef LUA_USE_BGSWEEP
+    lua_gcsweeper(L, 1);
+#endif
     luaL_register(L, "bit", bitLib);
     if (argc < 2) {
         return sizeof(void *);
     }
+    if (strcmp(argv[1], "-b") == 0 || strcmp(argv[1], "-s") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "usage: %s %s input.lua output\n", argv[0], argv[1]);
+            return 1;
+        }
+        if ((argv[1][1] == 'b' ? precompile : snapshot)(L, argv[2], argv[3]))
+            goto err;
+        lua_close(L);
+        return 0;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "usage: %s -r state.snap script.lua [args]\n", argv[0]);
+            return 1;
+        }
+        if (restore(L, argv[2]))
+            goto err;
+        argc -= 2;
+        argv += 2;
+    }
     lua_createTable(L, 0, 1);
     lua_pushstring(L, argv[1]);
     lua_rawSetI(L, -2, 0);
@@ -63,6 +63,25 @@ typedef unsigned long long U64;
 #define GCS_SWEEP        3   // 表示垃圾回收器正在进行清理操作
 #define GCS_FINALIZE    4   // 表示垃圾回收器正在执行对象的终结操作
 
+// Garbage collector modes
+#define LUA_GCINC        0   // 增量模式: 每一轮都标记并清扫全部对象
+#define LUA_GCGEN        1   // 分代模式: 小回收只标记和清扫上次回收之后新分配的对象
+
+// lua_gc 的操作
+#define LUA_GCSTOP       0   // 停止自动回收
+#define LUA_GCRESTART    1   // 恢复自动回收
+#define LUA_GCCOLLECT    2   // 做一次完整回收
+#define LUA_GCCOUNT      3   // 当前内存用量, 单位 KB
+#define LUA_GCCOUNTB     4   // 当前内存用量除以 1024 的余数, 单位字节
+#define LUA_GCSTEP       5   // 推进一步回收, 步长相当于分配了 data KB
+#define LUA_GCSETPAUSE   6   // 设置 gcpause, 返回旧值
+#define LUA_GCSETSTEPMUL 7   // 设置 gcstepmul, 返回旧值
+#define LUA_GCSETMAJORINC 8  // 设置分代模式的 gcmajorinc, 返回旧值
+
+// luaL_newState 可选的分配器
+#define LUA_ALLOC_MALLOC 0   // 每次分配都直接交给 realloc/free
+#define LUA_ALLOC_SLAB   1   // 小块按大小分级放在状态机自己的空闲链表里, 大块仍交给 malloc
+
 // pseudo-indices
 #define LUA_REGISTRY_INDEX        (-10000)                // 表示 Lua 注册表的索引
 #define LUA_ENVIRON_INDEX        (-10001)                // 表示环境表的索引
@@ -79,6 +98,8 @@ typedef unsigned long long U64;
 
 #define LUA_QL(x)"'"x"'"
 
+#define LUA_SIGNATURE   "\033Lua"    // 预编译代码块的文件头标记
+
 typedef struct lua_State lua_State;
 
 typedef int(*lua_CFunction)(lua_State *L);
@@ -88,6 +109,10 @@ typedef ptrdiff_t lua_Integer;
 
 typedef const char *(*lua_Reader)(lua_State *L, void *ud, size_t *sz);
 
+typedef int (*lua_Writer)(lua_State *L, const void *p, size_t sz, void *ud);
+
+typedef void (*lua_Release)(void *p, size_t sz);
+
 typedef void *(*lua_Alloc)(void *userdata, void *ptr, size_t oldSize, size_t newSize);
 
 typedef unsigned int lu_int32;
@@ -104,6 +129,24 @@ typedef struct luaL_Reg {
 
 #define UNUSED(x)((void)(x))
 
+#define LUA_GCHIST 16
+
+// lua_gcstats 取得的回收统计, 时间单位都是秒
+typedef struct lua_GCStats {
+    double phasetime[5];                // 各个 GCS_* 阶段花的时间
+    double atomictime;                  // atomic 累计时间
+    double atomicmax;                   // 最长的一次 atomic
+    double pausemax;                    // 最长的一次回收停顿
+    unsigned long pausehist[LUA_GCHIST]; // 停顿直方图: 第 i 格统计不到 2^i 微秒的停顿, 最后一格包括更长的
+    unsigned long cycles;               // 完成的完整回收轮数
+    unsigned long minors;               // 分代模式下的小回收次数
+    unsigned long marked;               // 标记过的对象数
+    unsigned long finalized;            // GCTM 调用过的终结器个数
+    unsigned long emergencies;          // 碰到内存上限做的紧急回收次数
+    lu_mem freed;                       // 清扫累计释放的字节数
+    lu_mem lastfreed;                   // 最近一次清扫释放的字节数
+} lua_GCStats;
+
 typedef lu_int32 Instruction;
 
 typedef union GCObject GCObject;
@@ -200,6 +243,9 @@ void lua_rawGetI(lua_State *L, int idx, int n);
 
 void lua_createTable(lua_State *L, int nArr, int nRec);
 
+// 清空表中所有的键值, 已分配的 array 和 node 存储留给之后复用
+void lua_cleartable(lua_State *L, int idx);
+
 void *lua_newUserdata(lua_State *L, size_t size);
 
 int lua_getmetatable(lua_State *L, int objindex);
@@ -228,12 +274,39 @@ int lua_pcall(lua_State *L, int nargs, int nResults, int errfunc);
 
 int lua_load(lua_State *L, lua_Reader reader, void *data, const char *chunkname);
 
+int lua_loadimage(lua_State *L, void *p, size_t size, lua_Release release, const char *chunkname);
+
+int lua_dump(lua_State *L, lua_Writer writer, void *data);
+
+int lua_dumpimage(lua_State *L, lua_Writer writer, void *data);
+
+int lua_snapshot(lua_State *L, lua_Writer writer, void *data);
+
+int lua_restore(lua_State *L, lua_Reader reader, void *data, const char *chunkname);
+
 
 // miscellaneous functions
 int lua_error(lua_State *L);
 
 int lua_next(lua_State *L, int idx);
 
+// 同 lua_next, 另带遍历游标: 首次传入 0, 之后原样传回, 每步不必再按键查找上一项
+int lua_nextat(lua_State *L, int idx, int *pos);
+
+int lua_gc(lua_State *L, int what, int data);
+
+int lua_gcmode(lua_State *L, int mode);
+
+void lua_gcstats(lua_State *L, lua_GCStats *s);
+
+int lua_gcworkers(lua_State *L, int n);
+
+int lua_gcsweeper(lua_State *L, int on);
+
+int lua_setarena(lua_State *L, size_t size);
+
+size_t lua_setmemlimit(lua_State *L, size_t limit);
+
 void lua_concat(lua_State *L, int n);
 
 
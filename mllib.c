@@ -1,8 +1,15 @@
+#include <errno.h>
 #include <time.h>
 #include <stdarg.h>
 
 #include "minilua.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define LUA_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #define luaL_addchar(B, c)((void)((B)->p<((B)->buffer+BUFSIZ)||luaL_prepbuffer(B)),(*(B)->p++=(char)(c)))
 #define luaL_addsize(B, n)((B)->p+=(n))
 #define luaL_checkint(L, n)((int)luaL_checkinteger(L,(n)))
@@ -290,16 +297,138 @@ static void *l_alloc(void *ud, void *ptr, size_t oldSize, size_t newSize) {
     return realloc(ptr, newSize);
 }
 
+// 小块分配器: 16 字节一级, 每个状态机一组空闲链表, 超过 SLAB_MAX 的块直接走 realloc/free.
+// Lua 释放时总会带上准确的旧大小, 所以块本身不用记录尺寸
+#define SLAB_ALIGN      16
+#define SLAB_MAX        512
+#define SLAB_CLASSES    (SLAB_MAX / SLAB_ALIGN)
+#define SLAB_CHUNK      (64 * 1024)
+#define slabclass(n)(((n) - 1) / SLAB_ALIGN)
+#define slabsize(c)(((c) + 1) * SLAB_ALIGN)
+
+// 后台清扫线程会在别的线程里释放对象, 这时分配器要加锁
+#if defined(LUA_USE_BGSWEEP) && defined(__GNUC__)
+#define slab_lock(p)while (__atomic_test_and_set(&(p)->lock, __ATOMIC_ACQUIRE))
+#define slab_unlock(p)__atomic_clear(&(p)->lock, __ATOMIC_RELEASE)
+#else
+#define slab_lock(p)((void)0)
+#define slab_unlock(p)((void)0)
+#endif
+
+typedef struct SlabPool {
+    void *free[SLAB_CLASSES];   // 每一级的空闲块, 块的第一个字指向下一个空闲块
+    char *chunks;               // 从 malloc 拿来的大块, 用开头的一个字串起来, 释放池子时一起还回去
+    char *bump;                 // 当前大块里还没切出去的部分
+    char *limit;
+    size_t live;                // 还没释放的块数
+    int adopted;                // 状态机创建成功后, live 降到 0 就说明 lua_close 结束, 释放整个池子
+    char lock;
+} SlabPool;
+
+static void slab_destroy(SlabPool *p) {
+    while (p->chunks != NULL) {
+        char *next = *(char **) p->chunks;
+        free(p->chunks);
+        p->chunks = next;
+    }
+    free(p);
+}
+
+static void *slab_get(SlabPool *p, size_t size) {
+    int c = slabclass(size);
+    void *b = p->free[c];
+    if (b != NULL) {
+        p->free[c] = *(void **) b;
+        return b;
+    }
+    if (p->limit - p->bump < (ptrdiff_t) slabsize(c)) {
+        char *chunk = (char *) malloc(SLAB_CHUNK);
+        if (chunk == NULL)
+            return NULL;
+        // 旧大块剩下的零头按能放下的最大一级放回空闲链表
+        while (p->limit - p->bump >= SLAB_ALIGN) {
+            int r = slabclass(p->limit - p->bump);
+            if (r >= SLAB_CLASSES)
+                r = SLAB_CLASSES - 1;
+            *(void **) p->bump = p->free[r];
+            p->free[r] = p->bump;
+            p->bump += slabsize(r);
+        }
+        *(char **) chunk = p->chunks;
+        p->chunks = chunk;
+        p->bump = chunk + SLAB_ALIGN;
+        p->limit = chunk + SLAB_CHUNK;
+    }
+    b = p->bump;
+    p->bump += slabsize(c);
+    return b;
+}
+
+static void *slab_realloc(SlabPool *p, void *ptr, size_t oldSize, size_t newSize) {
+    void *n = NULL;
+    if (ptr == NULL)
+        oldSize = 0;
+    if (oldSize > SLAB_MAX && newSize > SLAB_MAX)
+        return realloc(ptr, newSize);
+    if (oldSize != 0 && newSize != 0 && oldSize <= SLAB_MAX && newSize <= SLAB_MAX &&
+        slabclass(oldSize) == slabclass(newSize))
+        return ptr;
+    if (newSize != 0) {
+        n = newSize <= SLAB_MAX ? slab_get(p, newSize) : malloc(newSize);
+        if (n == NULL)
+            return NULL;
+        p->live++;
+        if (ptr != NULL)
+            memcpy(n, ptr, oldSize < newSize ? oldSize : newSize);
+    }
+    if (ptr != NULL) {
+        if (oldSize <= SLAB_MAX) {
+            int c = slabclass(oldSize);
+            *(void **) ptr = p->free[c];
+            p->free[c] = ptr;
+        } else {
+            free(ptr);
+        }
+        p->live--;
+    }
+    return n;
+}
+
+static void *slab_alloc(void *ud, void *ptr, size_t oldSize, size_t newSize) {
+    SlabPool *p = (SlabPool *) ud;
+    void *n;
+    int done;
+    slab_lock(p);
+    n = slab_realloc(p, ptr, oldSize, newSize);
+    done = (p->live == 0 && p->adopted);
+    slab_unlock(p);
+    // 最后一个块是 lua_close 释放的状态机本身, 之后不会再有人用这个池子
+    if (done)
+        slab_destroy(p);
+    return n;
+}
+
 static int panic(lua_State *L) {
     fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
             lua_tostring(L, -1));
     return 0;
 }
 
-lua_State *luaL_newState() {
-    lua_State *L = lua_newState(l_alloc, NULL);
+lua_State *luaL_newState(int alloc) {
+    lua_State *L;
+    SlabPool *p = NULL;
+    if (alloc == LUA_ALLOC_SLAB) {
+        p = (SlabPool *) calloc(1, sizeof(SlabPool));
+        if (p == NULL)
+            return NULL;
+    }
+    L = p ? lua_newState(slab_alloc, p) : lua_newState(l_alloc, NULL);
     if (L) {
         lua_atPanic(L, &panic);
+        if (p)
+            p->adopted = 1;
+    } else if (p) {
+        slab_destroy(p);
     }
     return L;
 }
@@ -374,8 +503,21 @@ static const char *getS(lua_State *L, void *ud, size_t *size) {
     return ls->s;
 }
 
-static int luaL_loadbuffer(lua_State *L, const char *buff, size_t size, const char *name) {
+// mode 同 5.2 的 load: 含 'b' 才接受预编译代码, 含 't' 才接受源码, NULL 表示都接受.
+// 预编译代码的校验只保证下标和跳转在界内, 所以脚本默认不加载它
+static int checkmode(lua_State *L, const char *mode, int c) {
+    const char *x = (c == LUA_SIGNATURE[0]) ? "binary" : "text";
+    if (mode == NULL || strchr(mode, x[0]) != NULL)
+        return 0;
+    lua_pushfstring(L, "attempt to load a %s chunk (mode is '%s')", x, mode);
+    return LUA_ERRSYNTAX;
+}
+
+static int luaL_loadbufferx(lua_State *L, const char *buff, size_t size, const char *name, const char *mode) {
     LoadS ls;
+    int status = checkmode(L, mode, size > 0 ? buff[0] : 0);
+    if (status != 0)
+        return status;
     ls.s = buff;
     ls.size = size;
     return lua_load(L, getS, &ls, name);
@@ -413,7 +555,28 @@ static int errFile(lua_State *L, const char *what, int fileNameIndex) {
 }
 
 
-int luaL_loadfile(lua_State *L, const char *filename) {
+#ifdef LUA_USE_MMAP
+static void unmapfile(void *p, size_t size) {
+    munmap(p, size);
+}
+
+// 把预编译文件整个映射进内存交给 lua_loadimage. 映射是私有可写的: 多个进程共享同一份物理页,
+// 只有被解释器改写过指令的页才会各自复制
+// 指令和字符串常量直接指向映射, 所以映像只能写到临时文件后 rename 替换 (见 precompile), 绝不能原地改写
+static int mapfile(lua_State *L, FILE *f, const char *chunkname, int *status) {
+    struct stat st;
+    void *p;
+    if (fstat(fileno(f), &st) != 0 || st.st_size <= 0)
+        return 0;
+    p = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+    if (p == MAP_FAILED)
+        return 0;
+    *status = lua_loadimage(L, p, (size_t) st.st_size, unmapfile, chunkname);
+    return 1;
+}
+#endif
+
+static int luaL_loadfilex(lua_State *L, const char *filename, const char *mode) {
     LoadF lf;
     int status, readStatus;
     int c;
@@ -433,10 +596,22 @@ int luaL_loadfile(lua_State *L, const char *filename) {
         while ((c = getc(lf.f)) != EOF && c != '\n');
         if (c == '\n')c = getc(lf.f);
     }
-    if (c == "\033Lua"[0] && filename) {
+    if ((status = checkmode(L, mode, c)) != 0) {
+        if (filename)fclose(lf.f);
+        lua_remove(L, fileNameIndex);
+        return status;
+    }
+    if (c == LUA_SIGNATURE[0] && filename) {
+#ifdef LUA_USE_MMAP
+        if (!lf.extraline && mapfile(L, lf.f, lua_tostring(L, -1), &status)) {
+            fclose(lf.f);
+            lua_remove(L, fileNameIndex);
+            return status;
+        }
+#endif
         lf.f = freopen(filename, "rb", lf.f);
         if (lf.f == NULL)return errFile(L, "reopen", fileNameIndex);
-        while ((c = getc(lf.f)) != EOF && c != "\033Lua"[0]);
+        while ((c = getc(lf.f)) != EOF && c != LUA_SIGNATURE[0]);
         lf.extraline = 0;
     }
     ungetc(c, lf.f);
@@ -451,6 +626,10 @@ int luaL_loadfile(lua_State *L, const char *filename) {
     return status;
 }
 
+int luaL_loadfile(lua_State *L, const char *filename) {
+    return luaL_loadfilex(L, filename, NULL);
+}
+
 static void luaL_buffinit(lua_State *L, luaL_Buffer *B) {
     B->L = L;
     B->p = B->buffer;
@@ -516,6 +695,18 @@ static const char *luaL_optlstring(lua_State *L, int narg, const char *def, size
     } else return luaL_checklstring(L, narg, len);
 }
 
+static int luaL_checkoption(lua_State *L, int narg, const char *def,
+                            const char *const lst[]) {
+    const char *name = (def) ? luaL_optstring(L, narg, def) :
+                       luaL_checkstring(L, narg);
+    int i;
+    for (i = 0; lst[i]; i++)
+        if (strcmp(lst[i], name) == 0)
+            return i;
+    return luaL_argerror(L, narg,
+                         lua_pushfstring(L, "invalid option " LUA_QL("%s"), name));
+}
+
 #define uchar(c)((unsigned char)(c))
 
 static ptrdiff_t posrelat(ptrdiff_t pos, size_t len) {
@@ -605,6 +796,23 @@ static int str_char(lua_State *L) {
     return 1;
 }
 
+static int writer(lua_State *L, const void *b, size_t size, void *B) {
+    (void) L;
+    luaL_addlstring((luaL_Buffer *) B, (const char *) b, size);
+    return 0;
+}
+
+static int str_dump(lua_State *L) {
+    luaL_Buffer b;
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_setTop(L, 1);
+    luaL_buffinit(L, &b);
+    if (lua_dump(L, writer, &b) != 0)
+        luaL_error(L, "unable to dump given function");
+    luaL_pushresult(&b);
+    return 1;
+}
+
 typedef struct MatchState {
     const char *src_init;
     const char *src_end;
@@ -1241,6 +1449,7 @@ static int str_format(lua_State *L) {
 const luaL_Reg strlib[] = {
         {"byte",   str_byte},
         {"char",   str_char},
+        {"dump",   str_dump},
         {"find",   str_find},
         {"format", str_format},
         {"gmatch", gmatch},
@@ -1620,6 +1829,76 @@ static int luaB_assert(lua_State *L) {
     return lua_getTop(L);
 }
 
+static void setnumfield(lua_State *L, const char *k, lua_Number v) {
+    lua_pushnumber(L, v);
+    lua_setField(L, -2, k);
+}
+
+// collectgarbage("stats") 返回的表, 字段和 lua_GCStats 一一对应
+static int gcstats(lua_State *L) {
+    static const char *const phases[] = {"pause", "propagate", "sweepstring", "sweep", "finalize"};
+    lua_GCStats s;
+    int i;
+    lua_gcstats(L, &s);
+    lua_createTable(L, 0, 13);
+    setnumfield(L, "cycles", (lua_Number) s.cycles);
+    setnumfield(L, "minors", (lua_Number) s.minors);
+    setnumfield(L, "marked", (lua_Number) s.marked);
+    setnumfield(L, "finalized", (lua_Number) s.finalized);
+    setnumfield(L, "emergencies", (lua_Number) s.emergencies);
+    setnumfield(L, "freed", (lua_Number) s.freed);
+    setnumfield(L, "lastfreed", (lua_Number) s.lastfreed);
+    setnumfield(L, "atomic", s.atomictime);
+    setnumfield(L, "atomicmax", s.atomicmax);
+    setnumfield(L, "pausemax", s.pausemax);
+    lua_createTable(L, 0, 5);
+    for (i = 0; i < 5; i++)
+        setnumfield(L, phases[i], s.phasetime[i]);
+    lua_setField(L, -2, "phases");
+    lua_createTable(L, LUA_GCHIST, 0);
+    for (i = 0; i < LUA_GCHIST; i++) {
+        lua_pushnumber(L, (lua_Number) s.pausehist[i]);
+        lua_rawSetI(L, -2, i + 1);
+    }
+    lua_setField(L, -2, "pausehist");
+    return 1;
+}
+
+static int luaB_collectgarbage(lua_State *L) {
+    static const char *const opts[] = {"stop", "restart", "collect",
+                                       "count", "step", "setpause", "setstepmul", "setmajorinc",
+                                       "incremental", "generational", "stats", NULL};
+    static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
+                                  LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL, LUA_GCSETMAJORINC};
+    int o = luaL_checkoption(L, 1, "collect", opts);
+    int ex = luaL_optint(L, 2, 0);
+    int res;
+    if (o == 10)
+        return gcstats(L);
+    // 切换回收模式, 返回原来的模式名
+    if (o >= 8) {
+        res = lua_gcmode(L, o == 8 ? LUA_GCINC : LUA_GCGEN);
+        lua_pushstring(L, opts[res == LUA_GCINC ? 8 : 9]);
+        return 1;
+    }
+    res = lua_gc(L, optsnum[o], ex);
+    switch (optsnum[o]) {
+        case LUA_GCCOUNT: {
+            int b = lua_gc(L, LUA_GCCOUNTB, 0);
+            lua_pushnumber(L, res + ((lua_Number) b / 1024));
+            return 1;
+        }
+        case LUA_GCSTEP: {
+            lua_pushboolean(L, res);
+            return 1;
+        }
+        default: {
+            lua_pushnumber(L, res);
+            return 1;
+        }
+    }
+}
+
 static int luaB_error(lua_State *L) {
     int level = luaL_optint(L, 2, 1);
     lua_setTop(L, 1);
@@ -1643,14 +1922,16 @@ static int load_aux(lua_State *L, int status) {
 
 static int luaB_loadfile(lua_State *L) {
     const char *fname = luaL_optstring(L, 1, NULL);
-    return load_aux(L, luaL_loadfile(L, fname));
+    const char *mode = luaL_optstring(L, 2, "t");
+    return load_aux(L, luaL_loadfilex(L, fname, mode));
 }
 
 static int luaB_loadstring(lua_State *L) {
     size_t l;
     const char *s = luaL_checklstring(L, 1, &l);
     const char *chunkname = luaL_optstring(L, 2, s);
-    return load_aux(L, luaL_loadbuffer(L, s, l, chunkname));
+    const char *mode = luaL_optstring(L, 3, "t");
+    return load_aux(L, luaL_loadbufferx(L, s, l, chunkname, mode));
 }
 
 static int luaB_next(lua_State *L) {
@@ -1783,6 +2064,7 @@ static int luaB_unpack(lua_State *L) {
 
 static const luaL_Reg base_funcs[] = {
         {"assert", luaB_assert},
+        {"collectgarbage", luaB_collectgarbage},
         {"error", luaB_error},
         {"loadfile", luaB_loadfile},
         {"loadstring", luaB_loadstring},
@@ -2040,9 +2322,27 @@ static int sort(lua_State *L) {
     return 0;
 }
 
+// table.new(narr, nrec): 按给定的数组部分和哈希部分大小预先分配
+static int tnew(lua_State *L) {
+    int narr = luaL_optint(L, 1, 0);
+    int nrec = luaL_optint(L, 2, 0);
+    luaL_argcheck(L, narr >= 0, 1, "size must be non-negative");
+    luaL_argcheck(L, nrec >= 0, 2, "size must be non-negative");
+    lua_createTable(L, narr, nrec);
+    return 1;
+}
+
+static int tclear(lua_State *L) {
+    luaL_checktype(L, 1, 5);
+    lua_cleartable(L, 1);
+    return 0;
+}
+
 static const luaL_Reg tab_funcs[] = {
+        {"clear",  tclear},
         {"concat", tconcat},
         {"insert", tinsert},
+        {"new",    tnew},
         {"remove", tremove},
         {"sort",   sort},
         {NULL, NULL}